@@ -0,0 +1,139 @@
+#ifndef __ASSIGNMENT_RING
+#define __ASSIGNMENT_RING
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+
+#include "calcOps.h"
+
+/*
+
+  Ring of ready-to-send assignments, filled ahead of time by one producer thread and drained by
+  any number of network workers (single producer, multiple consumers, no locks).
+
+  Every slot carries a sequence number (after Dmitry Vyukov's bounded queue). For the lap that
+  starts at position p the producer may fill the slot while seq == p, and publishes it by setting
+  seq = p + 1. A consumer claims position p by moving tail from p to p + 1 with a CAS once it sees
+  seq == p + 1, copies the assignment out and hands the slot back with seq = p + size. The
+  producer owns head, so only the consumers ever contend, and only on tail.
+
+  Each slot is one cache line, so neighbouring slots never share a line between threads.
+
+*/
+
+struct assignment {
+  double result;  // reference result
+  int len;        // bytes in msg, without the terminating NUL
+  short is_float;
+  short op;       // operator code, the position in calcLib's list
+  char msg[40];   // "<op> <v1> <v2>\n", the longest is "fdiv 1.2345678e-05 1.2345678e-05\n"
+};
+
+/* Work out the reference result of op on v1 and v2, and render the line we send. Returns false,
+   and leaves a unusable, if the line does not fit in msg; drawn operands always do. */
+static inline bool renderAssignment(int op, double v1, double v2, struct assignment *a) {
+  const struct calc_op_info *info = &calc_ops[op];
+  char *p = a->msg;
+  char *end = a->msg + sizeof(a->msg);
+  char value1[NUM_MAX_CHARS], value2[NUM_MAX_CHARS];
+
+  // "%s %8.8g %8.8g\n" for float operators, "%s %d %d\n" for integer ones. The values are
+  // formatted aside first, so a value that is longer than expected cannot run past msg.
+  int len1 = info->format(value1, v1);
+  int len2 = info->format(value2, v2);
+  if (info->name_len + len1 + len2 + 4 > end - p) { // Two blanks, '\n' and NUL
+    return false;
+  }
+
+  memcpy(p, info->name, info->name_len);
+  p += info->name_len;
+  *p++ = ' ';
+  memcpy(p, value1, len1);
+  p += len1;
+  *p++ = ' ';
+  memcpy(p, value2, len2);
+  p += len2;
+  *p++ = '\n';
+  *p = '\0';
+
+  a->result = info->eval(v1, v2);
+  a->is_float = info->is_float;
+  a->len = p - a->msg;
+  a->op = op;
+  return true;
+}
+
+struct alignas(64) ring_slot {
+  std::atomic<unsigned long> seq;
+  struct assignment a;
+};
+
+struct assignment_ring {
+  struct ring_slot *slots;
+  unsigned long mask;
+  alignas(64) std::atomic<unsigned long> tail; // next position to consume
+  alignas(64) unsigned long head;              // next position to fill, producer only
+};
+
+/* size must be a power of two. Returns 0 on success. */
+static inline int ringInit(struct assignment_ring *ring, unsigned long size) {
+  if (size == 0 || (size & (size - 1)) != 0) {
+    return -1;
+  }
+
+  ring->slots = new (std::nothrow) ring_slot[size];
+  if (ring->slots == NULL) {
+    return -1;
+  }
+
+  for (unsigned long i = 0; i < size; i++) {
+    ring->slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+  ring->mask = size - 1;
+  ring->tail.store(0, std::memory_order_relaxed);
+  ring->head = 0;
+  return 0;
+}
+
+/* Producer: the slot to fill next, or NULL while the ring is full. */
+static inline struct assignment *ringReserve(struct assignment_ring *ring) {
+  struct ring_slot *slot = &ring->slots[ring->head & ring->mask];
+  if (slot->seq.load(std::memory_order_acquire) != ring->head) {
+    return NULL;
+  }
+  return &slot->a;
+}
+
+/* Producer: hand the slot returned by ringReserve() to the consumers. */
+static inline void ringPublish(struct assignment_ring *ring) {
+  struct ring_slot *slot = &ring->slots[ring->head & ring->mask];
+  slot->seq.store(ring->head + 1, std::memory_order_release);
+  ring->head++;
+}
+
+/* Consumer: copy the oldest assignment into out. Returns 0 if the ring is empty. */
+static inline int ringPop(struct assignment_ring *ring, struct assignment *out) {
+  unsigned long pos = ring->tail.load(std::memory_order_relaxed);
+
+  while (1) {
+    struct ring_slot *slot = &ring->slots[pos & ring->mask];
+    long diff = (long)(slot->seq.load(std::memory_order_acquire) - (pos + 1));
+
+    if (diff == 0) {
+      if (ring->tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        *out = slot->a;
+        slot->seq.store(pos + ring->mask + 1, std::memory_order_release);
+        return 1;
+      }
+      // pos now holds the current tail, try again from there
+    } else if (diff < 0) {
+      return 0; // Not filled yet
+    } else {
+      pos = ring->tail.load(std::memory_order_relaxed); // Someone else took it
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,1000 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <calcLib.h>
+#include "calcOps.h"
+#include "numCodec.h"
+#include "binaryProtocol.h"
+#include "textProtocol.h"
+#include "lineReader.h"
+#include "assignmentRing.h"
+#include "sipHash.h"
+#include "metrics.h"
+#include "sessionTask.h"
+#include "trace.h"
+
+/*
+   Benchmarks for the calc server building blocks. Build with "make bench" (add CFLAGS=-O2 to
+   measure an optimized build) and run ./bench. The self-checks run first; if one fails, nothing
+   is measured.
+
+   Every measurement runs its loop WARMUP_RUNS times untimed, then --runs times timed, and reports
+   the median time per item over the timed runs and the median absolute deviation (MAD) from it:
+   both are robust against the odd run that gets preempted, and a MAD that is large next to the
+   median says the number is not to be trusted on this machine.
+
+   Options:
+     --runs N       timed runs per measurement (default DEFAULT_RUNS)
+     --filter TEXT  only the measurements whose name contains TEXT
+     --json         results as one JSON object on stdout instead of a table, for keeping and
+                    comparing between releases
+*/
+
+#define BATCH 1024
+#define ROUNDS 1000 // BATCH * ROUNDS assignments per run
+#define WARMUP_RUNS 2
+#define DEFAULT_RUNS 11
+#define MAX_RUNS 101
+
+static struct {
+  int runs;
+  int json;
+  const char *filter;
+  int reported; // measurements printed so far
+} options = {DEFAULT_RUNS, 0, NULL, 0};
+
+static double nowSec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile double sink; // Keeps the compiler from dropping the work
+
+static int compareDouble(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Median of the n values in v, which it sorts. */
+static double median(double *v, int n) {
+  qsort(v, n, sizeof(double), compareDouble);
+  return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static void printJsonString(const char *s) {
+  putchar('"');
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') {
+      putchar('\\');
+    }
+    putchar(*s);
+  }
+  putchar('"');
+}
+
+/*
+   Measures run, a callable that does one run's worth of work and returns how many items that
+   was, and reports the time per item as "<name>  ns/<unit>". Returns false if --filter left it
+   out. Each run should take a few
+   milliseconds, long enough for the clock and short enough that a dozen runs stay quick.
+*/
+template <typename F> static bool measure(const char *name, const char *unit, F run) {
+  if (options.filter != NULL && strstr(name, options.filter) == NULL) {
+    return false;
+  }
+
+  double ns[MAX_RUNS], deviation[MAX_RUNS];
+  long items = 0;
+  for (int i = 0; i < WARMUP_RUNS; i++) {
+    run();
+  }
+  for (int i = 0; i < options.runs; i++) {
+    double start = nowSec();
+    items = run();
+    ns[i] = (nowSec() - start) * 1e9 / items;
+  }
+
+  double best = INFINITY;
+  for (int i = 0; i < options.runs; i++) {
+    best = ns[i] < best ? ns[i] : best;
+  }
+  double mid = median(ns, options.runs);
+  for (int i = 0; i < options.runs; i++) {
+    deviation[i] = fabs(ns[i] - mid);
+  }
+  double mad = median(deviation, options.runs);
+
+  if (options.json) {
+    printf("%s\n    {\"name\": ", options.reported > 0 ? "," : "");
+    printJsonString(name);
+    printf(", \"unit\": \"ns/%s\", \"median\": %.3f, \"mad\": %.3f, \"min\": %.3f, \"items_per_run\": %ld}", unit, mid, mad,
+           best, items);
+  } else {
+    printf("%-36s %10.2f ns/%-10s +- %.2f\n", name, mid, unit, mad);
+  }
+  options.reported++;
+  return true;
+}
+
+static void benchPerCall(void) {
+  initCalcLib_seed(1);
+
+  measure("per call (randomType/Int/Float)", "assignment", [] {
+    double sum = 0;
+    for (long i = 0; i < (long)BATCH * ROUNDS; i++) {
+      char *op = randomType();
+      if (op[0] == 'f') {
+        sum += randomFloat() + randomFloat();
+      } else {
+        sum += randomInt() + randomInt();
+      }
+    }
+    sink = sum;
+    return (long)BATCH * ROUNDS;
+  });
+}
+
+static void benchPerCallReentrant(void) {
+  calc_rng_t rng;
+  initCalcLib_r(&rng, 1);
+
+  measure("per call, reentrant (_r)", "assignment", [&] {
+    double sum = 0;
+    for (long i = 0; i < (long)BATCH * ROUNDS; i++) {
+      char *op = randomType_r(&rng);
+      if (op[0] == 'f') {
+        sum += randomFloat_r(&rng) + randomFloat_r(&rng);
+      } else {
+        sum += randomInt_r(&rng) + randomInt_r(&rng);
+      }
+    }
+    sink = sum;
+    return (long)BATCH * ROUNDS;
+  });
+}
+
+static void benchBatch(int simd) {
+  static int ops[BATCH];
+  static double operands[2 * BATCH];
+  calc_batch_rng_t rng;
+  initCalcBatch_r(&rng, 1);
+
+  int used = calcBatchSimd(simd);
+  measure(used ? "batch, AVX2" : "batch, scalar", "assignment", [&] {
+    double sum = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+      randomAssignments_r(&rng, BATCH, ops, operands);
+      sum += operands[r % (2 * BATCH)] + ops[r % BATCH];
+    }
+    sink = sum;
+    return (long)BATCH * ROUNDS;
+  });
+  calcBatchSimd(1);
+}
+
+/* What sendAssignment() does per assignment besides the send: the reference result and the line,
+   with renderAssignment() itself. The operands come from a batch drawn beforehand. */
+static void benchRender(void) {
+  static int ops[BATCH];
+  static double operands[2 * BATCH];
+  calc_batch_rng_t rng;
+  initCalcBatch_r(&rng, 17);
+  randomAssignments_r(&rng, BATCH, ops, operands);
+
+  measure("render assignment line", "assignment", [] {
+    struct assignment a;
+    long len = 0;
+    for (int r = 0; r < ROUNDS / 10; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        renderAssignment(ops[i], operands[2 * i], operands[2 * i + 1], &a);
+        len += a.len;
+      }
+    }
+    sink = len + a.result;
+    return (long)BATCH * (ROUNDS / 10);
+  });
+}
+
+/* The SIMD and scalar batch paths must give the same assignments, also for odd counts. */
+static int checkBatch(void) {
+  if (!calcBatchSimd(1)) {
+    return 0; // Nothing to compare against
+  }
+
+  calc_batch_rng_t a, b;
+  initCalcBatch_r(&a, 7);
+  initCalcBatch_r(&b, 7);
+
+  for (int count = 1; count <= 67; count++) {
+    int ops_a[67], ops_b[67];
+    double operands_a[2 * 67], operands_b[2 * 67];
+
+    calcBatchSimd(1);
+    randomAssignments_r(&a, count, ops_a, operands_a);
+    calcBatchSimd(0);
+    randomAssignments_r(&b, count, ops_b, operands_b);
+
+    if (memcmp(ops_a, ops_b, count * sizeof(int)) != 0 ||
+        memcmp(operands_a, operands_b, 2 * count * sizeof(double)) != 0) {
+      fprintf(stderr, "batch mismatch between AVX2 and scalar at count %d\n", count);
+      calcBatchSimd(1);
+      return 1;
+    }
+  }
+
+  calcBatchSimd(1);
+  return 0;
+}
+
+/* A double with random bits, so every class of value (subnormal, huge, inf, nan) shows up. */
+static double randomBits(calc_rng_t *rng) {
+  union { unsigned long long u; double d; } v;
+  v.u = ((unsigned long long)randomInt_r(rng) << 57) ^ ((unsigned long long)(randomFloat_r(rng) * 1e15) << 7) ^
+        (unsigned long long)(randomFloat_r(rng) * 1e17);
+  return v.d;
+}
+
+static int sameDouble(double a, double b) {
+  return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+/* Randomized equivalence of numCodec.h against printf/atof. Returns the number of mismatches. */
+static int checkCodec(void) {
+  calc_rng_t rng;
+  initCalcLib_r(&rng, 9);
+  int bad = 0;
+
+  for (long i = 0; i < 3000000 && bad < 10; i++) {
+    double v;
+    switch (i % 6) {
+    case 0: v = randomFloat_r(&rng); break;                                 // operands
+    case 1: v = randomFloat_r(&rng) * randomFloat_r(&rng); break;           // fmul
+    case 2: v = randomFloat_r(&rng) / randomFloat_r(&rng); break;           // fdiv
+    case 3: v = randomFloat_r(&rng) - randomFloat_r(&rng); break;           // fsub
+    case 4: v = (double)((long long)(randomFloat_r(&rng) * 1e6) - 50000000); break;
+    default: v = randomBits(&rng); break;
+    }
+
+    char expect[64], got[NUM_MAX_CHARS + 1];
+    snprintf(expect, sizeof(expect), "%8.8g", v);
+    got[formatG8(got, v)] = '\0';
+    if (strcmp(expect, got) != 0) {
+      fprintf(stderr, "formatG8(%.17g): printf \"%s\", codec \"%s\"\n", v, expect, got);
+      bad++;
+    }
+
+    double back = parseDouble(expect, expect + strlen(expect));
+    if (!sameDouble(back, atof(expect))) {
+      fprintf(stderr, "parseDouble(\"%s\"): atof %.17g, codec %.17g\n", expect, atof(expect), back);
+      bad++;
+    }
+
+    long long n = ((long long)randomInt_r(&rng) - 50) * (1LL << (i % 57));
+    snprintf(expect, sizeof(expect), "%lld", n);
+    got[formatInt(got, n)] = '\0';
+    if (strcmp(expect, got) != 0 || parseInt(expect, expect + strlen(expect)) != atoll(expect)) {
+      fprintf(stderr, "formatInt/parseInt(%lld): printf \"%s\", codec \"%s\"\n", n, expect, got);
+      bad++;
+    }
+  }
+
+  // What clients send back, with the blanks and signs atof lets through
+  const char *answers[] = {"42\n", "   1.5\n", "-7", "+3.25\n", "\t12e-3", "abc", "", "+-1", "  -0\n", "99999999999"};
+  for (unsigned i = 0; i < sizeof(answers) / sizeof(answers[0]); i++) {
+    const char *a = answers[i];
+    if (!sameDouble(parseDouble(a, a + strlen(a)), atof(a)) || parseInt(a, a + strlen(a)) != atoll(a)) {
+      fprintf(stderr, "parse(\"%s\") differs from atof/atoll\n", a);
+      bad++;
+    }
+  }
+
+  return bad;
+}
+
+static void benchCodec(void) {
+  static double values[BATCH];
+  static char lines[BATCH][NUM_MAX_CHARS];
+  calc_rng_t rng;
+  initCalcLib_r(&rng, 3);
+  for (int i = 0; i < BATCH; i++) {
+    values[i] = randomFloat_r(&rng);
+    snprintf(lines[i], sizeof(lines[i]), "%8.8g", values[i]);
+  }
+
+  const int rounds = ROUNDS / 10;
+
+  measure("sprintf(\"%8.8g\")", "op", [&] {
+    char out[64];
+    long sum = 0;
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        sum += sprintf(out, "%8.8g", values[i]);
+      }
+    }
+    sink = sum;
+    return (long)BATCH * rounds;
+  });
+
+  measure("formatG8", "op", [&] {
+    char out[64];
+    long sum = 0;
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        sum += formatG8(out, values[i]);
+      }
+    }
+    sink = sum;
+    return (long)BATCH * rounds;
+  });
+
+  measure("atof", "op", [&] {
+    double sum = 0;
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        sum += atof(lines[i]);
+      }
+    }
+    sink = sum;
+    return (long)BATCH * rounds;
+  });
+
+  measure("parseDouble", "op", [&] {
+    double sum = 0;
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        sum += parseDouble(lines[i], lines[i] + strlen(lines[i]));
+      }
+    }
+    sink = sum;
+    return (long)BATCH * rounds;
+  });
+}
+
+#define GRADE_ITEMS (1 << 20) // answers per gradeAnswers() call in the benchmark
+
+static double grade_expected[GRADE_ITEMS], grade_answers[GRADE_ITEMS];
+static unsigned char grade_is_float[GRADE_ITEMS];
+
+/* Reference results of random assignments, and answers that are right, a little off, far off or
+   not numbers at all. */
+static void makeGradeInput(int count) {
+  static int ops[GRADE_ITEMS];
+  static double operands[2 * GRADE_ITEMS];
+  static const double offsets[] = {0, 0, 0, 0, 0.00005, -0.00009, 0.0001, 0.0002, 1, -1, 0.5, 1e9};
+  calc_batch_rng_t batch;
+  calc_rng_t rng;
+  initCalcBatch_r(&batch, 13);
+  initCalcLib_r(&rng, 13);
+  randomAssignments_r(&batch, count, ops, operands);
+
+  for (int i = 0; i < count; i++) {
+    grade_expected[i] = calcEval(ops[i], operands[2 * i], operands[2 * i + 1]);
+    grade_is_float[i] = calcOpIsFloat(ops[i]);
+    int pick = randomInt_r(&rng) % 13;
+    grade_answers[i] = pick < 12 ? grade_expected[i] + offsets[pick] : randomBits(&rng);
+  }
+}
+
+/* gradeAnswers() must agree with the per-answer check the server used to do, with and without AVX2,
+   for every count up to a few words. Returns the number of mismatches. */
+static int checkGrade(void) {
+  const int items = 300;
+  unsigned long long correct[(items + 63) / 64];
+  int bad = 0;
+
+  makeGradeInput(items);
+  for (int simd = 0; simd <= 1; simd++) {
+    calcBatchSimd(simd);
+    for (int count = 0; count <= items && bad < 10; count++) {
+      gradeAnswers(count, grade_expected, grade_answers, grade_is_float, correct);
+      for (int i = 0; i < count; i++) {
+        double e = grade_expected[i], a = grade_answers[i];
+        int expect = grade_is_float[i] ? fabs(a - e) < 0.0001 : (int)a == (int)e;
+        if ((int)((correct[i / 64] >> (i % 64)) & 1) != expect) {
+          fprintf(stderr, "gradeAnswers (%s, count %d) grades %.17g against %.17g wrong\n", simd ? "AVX2" : "scalar", count, a, e);
+          bad++;
+          break;
+        }
+      }
+    }
+  }
+  calcBatchSimd(1);
+  return bad;
+}
+
+static void benchGrade(int simd) {
+  static unsigned long long correct[GRADE_ITEMS / 64];
+
+  makeGradeInput(GRADE_ITEMS);
+  int used = calcBatchSimd(simd);
+  measure(used ? "grade 1M answers, AVX2" : "grade 1M answers, scalar", "answer", [] {
+    gradeAnswers(GRADE_ITEMS, grade_expected, grade_answers, grade_is_float, correct);
+    sink = __builtin_popcountll(correct[0]);
+    return (long)GRADE_ITEMS;
+  });
+  calcBatchSimd(1);
+}
+
+/* What the server does with the answers of a pipelined session: parse each line, then grade them
+   all with one gradeAnswers(), as gradeSession() does. */
+static void benchAnswers(void) {
+  static char lines[BATCH][NUM_MAX_CHARS + 1];
+  static int lens[BATCH];
+  static double expected[BATCH], answers[BATCH];
+  static unsigned char is_float[BATCH];
+  static unsigned long long correct[BATCH / 64];
+
+  makeGradeInput(BATCH);
+  for (int i = 0; i < BATCH; i++) {
+    expected[i] = grade_expected[i];
+    is_float[i] = grade_is_float[i];
+    lens[i] = formatG8(lines[i], grade_answers[i]);
+    lines[i][lens[i]] = '\0';
+  }
+
+  measure("parse and grade answers", "answer", [] {
+    long ok = 0;
+    for (int r = 0; r < ROUNDS / 10; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        answers[i] = parseDouble(lines[i], lines[i] + lens[i]);
+      }
+      gradeAnswers(BATCH, expected, answers, is_float, correct);
+      ok += __builtin_popcountll(correct[r % (BATCH / 64)]);
+    }
+    sink = ok;
+    return (long)BATCH * (ROUNDS / 10);
+  });
+}
+
+/* Every operator name must look up to its own code, and nothing else may look up at all. Returns the number of mismatches. */
+static int checkOps(void) {
+  static const char *not_ops[] = {"", "a", "ad", "addd", "fad", "Add", "dvi", "fsu", "fsubb", "ok", "ERROR"};
+  int bad = 0;
+
+  for (int op = 0; op < CALC_OP_COUNT; op++) {
+    if (calcOpLookup(calc_ops[op].name) != op || strcmp(calc_ops[op].name, opName(op)) != 0 ||
+        calc_ops[op].is_float != opIsFloat(op)) {
+      fprintf(stderr, "operator %s does not match calcLib\n", calc_ops[op].name);
+      bad++;
+    }
+  }
+  for (const char *name : not_ops) {
+    if (calcOpLookup(name) != -1) {
+      fprintf(stderr, "\"%s\" looks up as an operator\n", name);
+      bad++;
+    }
+  }
+  return bad;
+}
+
+/* The operator names of a batch, looked up with the strcmp() chain the programs used before and with calcOpLookup(). */
+static void benchOps(void) {
+  static int ops[BATCH];
+  static double operands[2 * BATCH];
+  static std::string_view names[BATCH];
+  calc_batch_rng_t rng;
+  initCalcBatch_r(&rng, 5);
+  randomAssignments_r(&rng, BATCH, ops, operands);
+  for (int i = 0; i < BATCH; i++) {
+    names[i] = calc_ops[ops[i]].name;
+  }
+
+  const int rounds = ROUNDS / 10;
+
+  measure("operator by strcmp() chain", "op", [&] {
+    long sum = 0;
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        const char *name = names[i].data();
+        if (strcmp(name, "fadd") == 0) {
+          sum += CALC_FADD;
+        } else if (strcmp(name, "fsub") == 0) {
+          sum += CALC_FSUB;
+        } else if (strcmp(name, "fmul") == 0) {
+          sum += CALC_FMUL;
+        } else if (strcmp(name, "fdiv") == 0) {
+          sum += CALC_FDIV;
+        } else if (strcmp(name, "add") == 0) {
+          sum += CALC_ADD;
+        } else if (strcmp(name, "sub") == 0) {
+          sum += CALC_SUB;
+        } else if (strcmp(name, "mul") == 0) {
+          sum += CALC_MUL;
+        } else if (strcmp(name, "div") == 0) {
+          sum += CALC_DIV;
+        }
+      }
+    }
+    sink = sum;
+    return (long)BATCH * rounds;
+  });
+
+  measure("operator by calcOpLookup", "op", [&] {
+    long sum = 0;
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        sum += calcOpLookup(names[i]);
+      }
+    }
+    sink = sum;
+    return (long)BATCH * rounds;
+  });
+}
+
+/* Every record must come back from binaryDecode() as it went into binaryEncode(). Returns the number of mismatches. */
+static int checkBinary(void) {
+  static int ops[BATCH];
+  static double operands[2 * BATCH];
+  calc_batch_rng_t rng;
+  initCalcBatch_r(&rng, 11);
+  randomAssignments_r(&rng, BATCH, ops, operands);
+  int bad = 0;
+
+  for (int i = 0; i < BATCH && bad < 10; i++) {
+    for (int type = BINARY_ASSIGNMENT; type <= BINARY_TIMEOUT; type++) {
+      struct binary_record in = {type, ops[i], 0, 0, 0}, out;
+      unsigned char record[BINARY_MAX_RECORD];
+
+      if (type == BINARY_ASSIGNMENT) {
+        in.value1 = operands[2 * i];
+        in.value2 = operands[2 * i + 1];
+      } else if (type == BINARY_ANSWER) {
+        in.result = calcEval(ops[i], operands[2 * i], operands[2 * i + 1]);
+      }
+
+      int len = binaryEncode(record, &in);
+      if (!binaryDecode(record, len, &out) || out.type != in.type || out.op != in.op ||
+          !sameDouble(out.value1, in.value1) || !sameDouble(out.value2, in.value2) || !sameDouble(out.result, in.result)) {
+        fprintf(stderr, "binary record type %d op %s does not round trip\n", type, calc_ops[ops[i]].name);
+        bad++;
+      }
+    }
+  }
+  return bad;
+}
+
+/* SipHash-2-4 against the vectors of the reference implementation (key 00..0f, message 00..len-1). */
+static int checkSipHash(void) {
+  static const unsigned long long expect[] = {0x726fdb47dd0e0e31ULL, 0x74f839c593dc67fdULL, 0x0d6c8009d9a94f5aULL,
+                                              0x85676696d7fb7e2dULL, 0xcf2794e0277187b7ULL, 0x18765564cd99a68dULL,
+                                              0xcbc9466e58fee3ceULL, 0xab0200f58b01d137ULL, 0x93f5f5799a932462ULL,
+                                              0x9e0082df0ba9e4b0ULL, 0x7a5dbbc594ddb9f3ULL, 0xf4b32f46226bada7ULL,
+                                              0x751e8fbc860ee5fbULL, 0x14ea5627c0843d90ULL, 0xf723ca908e7af2eeULL,
+                                              0xa129ca6149be45e5ULL, 0x3f2acc7f57c29bdbULL};
+  unsigned char key[SIP_HASH_KEY_SIZE], msg[17];
+  int bad = 0;
+
+  for (int i = 0; i < SIP_HASH_KEY_SIZE; i++) {
+    key[i] = i;
+  }
+  for (int len = 0; len < 17; len++) {
+    msg[len] = len;
+    if (sipHash24(key, msg, len) != expect[len]) {
+      fprintf(stderr, "sipHash24 of %d bytes: %016llx, expected %016llx\n", len, (unsigned long long)sipHash24(key, msg, len), expect[len]);
+      bad++;
+    }
+  }
+  return bad;
+}
+
+/* The client's side of an assignment line (without its '\n'): the client's own helpers from
+   textProtocol.h split it, solve it and write the answer line to answer. Returns its length, 0 if
+   the line is malformed. */
+static int solveAssignment(std::string_view line, char *answer) {
+  struct assignment_fields fields;
+  if (!splitAssignment(line, &fields)) {
+    return 0;
+  }
+  return answerAssignment(&fields, answer);
+}
+
+/* The server's grading of one answer, through gradeAnswers() as in gradeSession(). */
+static bool gradeAnswer(double expected, int is_float, double got) {
+  unsigned char flag = is_float;
+  unsigned long long ok;
+  gradeAnswers(1, &expected, &got, &flag, &ok);
+  return ok & 1;
+}
+
+/*
+   The message work of one single-assignment session, both sides, without the sockets: the server
+   renders the assignment, the client reads it and writes its answer, the server reads and grades
+   the answer and writes the verdict, the client reads the verdict. Bytes count everything after
+   the greeting, which is the same for both protocols.
+*/
+static long textSession(int op, double v1, double v2, int *correct) {
+  struct assignment a;
+  char answer[NUM_MAX_CHARS + 1];
+  long bytes = 3; // "OK\n"
+
+  // Server: "<op> <v1> <v2>\n"
+  renderAssignment(op, v1, v2, &a);
+  bytes += a.len;
+
+  // Client: split on blanks, look up the operator, parse, solve, format
+  int answer_len = solveAssignment(std::string_view(a.msg, a.len - 1), answer);
+  bytes += answer_len;
+
+  // Server: parse and grade, "OK\n" or "ERROR\n"
+  double got = parseDouble(answer, answer + answer_len - 1);
+  const char *verdict = gradeAnswer(a.result, a.is_float, got) ? "OK\n" : "ERROR\n";
+  bytes += strlen(verdict);
+
+  // Client: read the verdict
+  *correct = strncmp(verdict, "OK\n", 3) == 0;
+  return bytes;
+}
+
+static long binarySession(int op, double v1, double v2, int *correct) {
+  unsigned char assignment[BINARY_MAX_RECORD], answer[BINARY_MAX_RECORD], verdict[BINARY_MAX_RECORD];
+  struct binary_record r = {BINARY_ASSIGNMENT, op, v1, v2, 0};
+  long bytes = 15; // "BINARY TCP 1.0\n"
+
+  int assignment_len = binaryEncode(assignment, &r);
+  bytes += assignment_len;
+
+  // Client
+  binaryDecode(assignment, assignment_len, &r);
+  r.type = BINARY_ANSWER;
+  r.result = calcEval(r.op, r.value1, r.value2);
+  int answer_len = binaryEncode(answer, &r);
+  bytes += answer_len;
+
+  // Server
+  binaryDecode(answer, answer_len, &r);
+  double expected = calcEval(op, v1, v2);
+  r.type = gradeAnswer(expected, calcOpIsFloat(op), r.result) ? BINARY_OK : BINARY_ERROR;
+  int verdict_len = binaryEncode(verdict, &r);
+  bytes += verdict_len;
+
+  // Client
+  binaryDecode(verdict, verdict_len, &r);
+  *correct = r.type == BINARY_OK;
+  return bytes;
+}
+
+static void benchProtocol(int binary) {
+  static int ops[BATCH];
+  static double operands[2 * BATCH];
+  calc_batch_rng_t rng;
+  initCalcBatch_r(&rng, 5);
+  randomAssignments_r(&rng, BATCH, ops, operands);
+
+  const int rounds = ROUNDS / 10;
+  long bytes = 0, ok = 0;
+
+  bool measured = measure(binary ? "session messages, BINARY TCP 1.0" : "session messages, TEXT TCP 1.0", "session", [&] {
+    bytes = ok = 0;
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        int correct;
+        if (binary) {
+          bytes += binarySession(ops[i], operands[2 * i], operands[2 * i + 1], &correct);
+        } else {
+          bytes += textSession(ops[i], operands[2 * i], operands[2 * i + 1], &correct);
+        }
+        ok += correct;
+      }
+    }
+    return (long)BATCH * rounds;
+  });
+
+  long sessions = (long)BATCH * rounds;
+  if (measured && !options.json) {
+    printf("%-36s %10.1f bytes/session, %.2f%% OK\n", "", (double)bytes / sessions, 100.0 * ok / sessions);
+  }
+}
+
+/* Next line from fd, receiving until one is complete. False if the peer closed or recv() failed. */
+static bool readLine(line_reader *in, int fd, std::string_view *line) {
+  while (!lineReaderNext(in, line)) {
+    if (lineReaderFill(in, fd) <= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+   A whole TEXT TCP 1.0 session through the kernel: both ends of a socketpair, played one after
+   the other by this thread. The server greets, reads the client's "OK", sends the assignment,
+   parses and grades the answer and sends the verdict; the client does its part in between. The
+   socketpair() and the two close()s stand in for connect, accept and the hangup. Both sides use
+   the server's and client's shared pieces (GREETING, renderAssignment(), the textProtocol.h
+   solver, gradeAnswers()), but not their event loops, so this is the session's message and
+   socket work without the scheduling around it. Returns 1 if the verdict was OK, 0 if not, -1
+   if the session failed.
+*/
+static int socketSession(const struct assignment *a) {
+  static line_reader server_in, client_in;
+  std::string_view line;
+  int correct = -1;
+  int fds[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+    return -1;
+  }
+  int server = fds[0], client = fds[1];
+  lineReaderInit(&server_in);
+  lineReaderInit(&client_in);
+
+  send(server, GREETING, strlen(GREETING), MSG_NOSIGNAL);
+  while (readLine(&client_in, client, &line) && !line.empty()) {
+  }
+  send(client, "OK\n", 3, MSG_NOSIGNAL);
+
+  if (readLine(&server_in, server, &line) && line == "OK") {
+    send(server, a->msg, a->len, MSG_NOSIGNAL);
+
+    char answer[NUM_MAX_CHARS + 1];
+    int answer_len;
+    if (readLine(&client_in, client, &line) && (answer_len = solveAssignment(line, answer)) > 0) {
+      send(client, answer, answer_len, MSG_NOSIGNAL);
+
+      if (readLine(&server_in, server, &line)) {
+        double got = parseDouble(line.data(), line.data() + line.size());
+        const char *verdict = gradeAnswer(a->result, a->is_float, got) ? "OK\n" : "ERROR\n";
+        send(server, verdict, strlen(verdict), MSG_NOSIGNAL);
+
+        if (readLine(&client_in, client, &line)) {
+          correct = line == "OK";
+        }
+      }
+    }
+  }
+
+  close(server);
+  close(client);
+  return correct;
+}
+
+static void benchSocketSession(void) {
+  static struct assignment assignments[BATCH];
+  static int ops[BATCH];
+  static double operands[2 * BATCH];
+  calc_batch_rng_t rng;
+  initCalcBatch_r(&rng, 19);
+  randomAssignments_r(&rng, BATCH, ops, operands);
+  for (int i = 0; i < BATCH; i++) {
+    renderAssignment(ops[i], operands[2 * i], operands[2 * i + 1], &assignments[i]);
+  }
+
+  const int rounds = 10;
+  long ok = 0, failed = 0;
+
+  bool measured = measure("session over socketpair, TEXT TCP 1.0", "session", [&] {
+    ok = failed = 0;
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < BATCH; i++) {
+        int correct = socketSession(&assignments[i]);
+        ok += correct == 1;
+        failed += correct == -1;
+      }
+    }
+    return (long)BATCH * rounds;
+  });
+
+  if (failed > 0) {
+    fprintf(stderr, "%ld of %ld socketpair sessions failed\n", failed, (long)BATCH * rounds);
+  }
+  if (measured && !options.json) {
+    printf("%-36s %10.2f%% OK\n", "", 100.0 * ok / ((long)BATCH * rounds));
+  }
+}
+
+/* What the server pays on the hot path per recorded event. */
+static void benchMetrics(void) {
+  static struct worker_metrics m;
+  const long samples = (long)BATCH * ROUNDS;
+  long long ns = 0;
+
+  measure("metricsCount", "op", [&] {
+    for (long i = 0; i < samples; i++) {
+      metricsCount(&m.ok[i % METRICS_OPS]);
+    }
+    return samples;
+  });
+
+  measure("metricsRecord", "op", [&] {
+    for (long i = 0; i < samples; i++) {
+      ns = ns * 6364136223846793005LL + 1442695040888963407LL; // Spread the samples over all buckets
+      metricsRecord(&m, PHASE_SESSION, (unsigned long long)ns >> 38);
+    }
+    return samples;
+  });
+
+  measure("clock_gettime (per timestamp)", "op", [&] {
+    for (long i = 0; i < samples / 10; i++) {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      ns += ts.tv_nsec;
+    }
+    return samples / 10;
+  });
+
+  sink = m.ok[0].load() + m.phases[PHASE_SESSION].sum_ns.load() + ns;
+}
+
+/* What --record adds per assignment on the worker. The trace thread is played by the loop itself,
+   which empties the blocks whenever they are all full. */
+static void benchTrace(void) {
+  static struct trace_buffer tb;
+  struct trace_record r;
+  const long records = (long)BATCH * ROUNDS;
+
+  if (traceBufferInit(&tb) != 0) {
+    return;
+  }
+  memset(&r, 0, sizeof(r));
+
+  measure("traceAppend", "op", [&] {
+    for (long i = 0; i < records; i++) {
+      r.value1 = i;
+      r.index = i;
+      while (!traceAppend(&tb, &r, i >> 10)) {
+        unsigned long written = tb.written.load();
+        tb.blocks[written % TRACE_BLOCKS].count = 0;
+        tb.written.store(written + 1);
+      }
+    }
+    return records;
+  });
+
+  free(tb.blocks);
+}
+
+/*
+   The server's session coroutine without the I/O: start, wait twice (protocol choice, answer),
+   finish. Against the switch over a state field it replaced, to see what the frame and the
+   resumes cost per session.
+*/
+#define TASK_SESSIONS 64 // sessions in flight at once
+
+struct toy_session {
+  int state;
+  int event;
+  long sum;
+  std::coroutine_handle<> task;
+};
+
+struct toy_wait {
+  struct toy_session *s;
+
+  bool await_ready() { return false; }
+  void await_suspend(std::coroutine_handle<>) {}
+  int await_resume() { return s->event; }
+};
+
+static session_task toyRun(struct toy_session *s) {
+  s->sum += co_await toy_wait{s};
+  s->sum += co_await toy_wait{s};
+}
+
+static void toyStep(struct toy_session *s, int event) {
+  switch (s->state) {
+  case 0:
+    s->sum += event;
+    s->state = 1;
+    break;
+  case 1:
+    s->sum += event;
+    s->state = 2;
+    break;
+  }
+}
+
+static void benchSessionTask(void) {
+  static struct toy_session sessions[TASK_SESSIONS];
+  const long rounds = ROUNDS * 4;
+  long sum = 0;
+
+  measure("session coroutine, pooled frame", "session", [&] {
+    for (long r = 0; r < rounds; r++) {
+      for (int i = 0; i < TASK_SESSIONS; i++) {
+        sessions[i].sum = 0;
+        sessions[i].task = toyRun(&sessions[i]).handle;
+      }
+      for (int event = 1; event <= 2; event++) {
+        for (int i = 0; i < TASK_SESSIONS; i++) {
+          sessions[i].event = event + r;
+          sessions[i].task.resume();
+        }
+      }
+      for (int i = 0; i < TASK_SESSIONS; i++) {
+        sum += sessions[i].sum;
+        sessions[i].task.destroy();
+      }
+    }
+    return rounds * TASK_SESSIONS;
+  });
+
+  measure("session state machine", "session", [&] {
+    for (long r = 0; r < rounds; r++) {
+      for (int i = 0; i < TASK_SESSIONS; i++) {
+        sessions[i].sum = 0;
+        sessions[i].state = 0;
+      }
+      for (int event = 1; event <= 2; event++) {
+        for (int i = 0; i < TASK_SESSIONS; i++) {
+          toyStep(&sessions[i], event + r);
+        }
+      }
+      for (int i = 0; i < TASK_SESSIONS; i++) {
+        sum += sessions[i].sum;
+      }
+    }
+    return rounds * TASK_SESSIONS;
+  });
+
+  sink = sum;
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      options.json = 1;
+    } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      options.runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else {
+      fprintf(stderr, "Usage: %s [--runs N] [--filter TEXT] [--json]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (options.runs < 1 || options.runs > MAX_RUNS) {
+    fprintf(stderr, "--runs must be 1 to %d\n", MAX_RUNS);
+    return 1;
+  }
+
+  if (checkBatch() != 0) {
+    return 1;
+  }
+  if (checkCodec() != 0) {
+    fprintf(stderr, "numCodec.h does not match printf/atof\n");
+    return 1;
+  }
+  if (checkOps() != 0 || checkGrade() != 0 || checkBinary() != 0 || checkSipHash() != 0) {
+    return 1;
+  }
+
+  if (options.json) {
+#ifdef __OPTIMIZE__
+    const char *optimized = "true";
+#else
+    const char *optimized = "false";
+#endif
+    printf("{\n  \"compiler\": ");
+    printJsonString(__VERSION__);
+    printf(",\n  \"optimized\": %s,\n  \"avx2\": %s,\n  \"warmup_runs\": %d,\n  \"runs\": %d,\n  \"benchmarks\": [",
+           optimized, calcBatchSimd(1) ? "true" : "false", WARMUP_RUNS, options.runs);
+  }
+
+  benchPerCall();
+  benchPerCallReentrant();
+  benchBatch(0);
+  benchBatch(1);
+  benchRender();
+  benchCodec();
+  benchOps();
+  benchGrade(0);
+  benchGrade(1);
+  benchAnswers();
+  benchProtocol(0);
+  benchProtocol(1);
+  benchSocketSession();
+  benchMetrics();
+  benchSessionTask();
+  benchTrace();
+
+  if (options.json) {
+    printf("\n  ]\n}\n");
+  }
+  return 0;
+}
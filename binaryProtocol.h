@@ -0,0 +1,149 @@
+#ifndef __BINARY_PROTOCOL
+#define __BINARY_PROTOCOL
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lineReader.h"
+#include "calcOps.h"
+
+/*
+
+  BINARY TCP 1.0, the compact alternative to the text protocols.
+
+  The greeting and the client's choice are text lines like for TEXT TCP ("BINARY TCP 1.0\n" for one
+  assignment, "BINARY TCP 1.0 <N>\n" for N of them, pipelined like TEXT TCP 1.1). From then on both
+  sides only exchange little-endian records. Every record starts with
+
+     offset 0  u8  type   BINARY_ASSIGNMENT, BINARY_ANSWER, BINARY_OK, BINARY_ERROR, BINARY_TIMEOUT
+     offset 1  u8  op     operator code, enum calc_op (calc_ops[op].name is the text)
+
+  and these two bytes fix the size of the rest. Values are int32 for integer operators and
+  float64 for float ones:
+
+     BINARY_ASSIGNMENT  value 1, value 2     10 bytes (integer op) or 18 (float op), server to client
+     BINARY_ANSWER      result                6 bytes (integer op) or 10 (float op), client to server
+     BINARY_OK, ...     nothing               2 bytes, server to client
+
+  The server sends the assignments, the client sends one answer per assignment, and the server
+  replies with a BINARY_OK or BINARY_ERROR per answer (or one BINARY_TIMEOUT). Values go over as
+  the exact numbers the server drew, so nothing is formatted, parsed or rounded on the way.
+
+*/
+
+#define BINARY_HEADER_SIZE 2
+#define BINARY_MAX_RECORD 18
+
+enum binary_type { BINARY_ASSIGNMENT = 1, BINARY_ANSWER, BINARY_OK, BINARY_ERROR, BINARY_TIMEOUT };
+
+struct binary_record {
+  int type;
+  int op;
+  double value1; // integer operators keep their int32 values here too
+  double value2;
+  double result;
+};
+
+/* Bytes in a record of this type and op, 0 if either is unknown. */
+static inline int binaryRecordSize(int type, int op) {
+  if (op < 0 || op >= CALC_OP_COUNT) {
+    return 0;
+  }
+
+  int value_size = calcOpIsFloat(op) ? 8 : 4;
+  switch (type) {
+  case BINARY_ASSIGNMENT: return BINARY_HEADER_SIZE + 2 * value_size;
+  case BINARY_ANSWER: return BINARY_HEADER_SIZE + value_size;
+  case BINARY_OK:
+  case BINARY_ERROR:
+  case BINARY_TIMEOUT: return BINARY_HEADER_SIZE;
+  }
+  return 0;
+}
+
+// Byte order is spelled out with shifts, the compiler turns them into plain loads and stores
+static inline void binaryPutValue(unsigned char *p, int is_float, double v) {
+  uint64_t bits;
+  int size = 4;
+
+  if (is_float) {
+    memcpy(&bits, &v, sizeof(bits));
+    size = 8;
+  } else {
+    bits = (uint32_t)(int32_t)v;
+  }
+  for (int i = 0; i < size; i++) {
+    p[i] = bits >> (8 * i);
+  }
+}
+
+static inline double binaryGetValue(const unsigned char *p, int is_float) {
+  uint64_t bits = 0;
+  int size = is_float ? 8 : 4;
+
+  for (int i = 0; i < size; i++) {
+    bits |= (uint64_t)p[i] << (8 * i);
+  }
+  if (is_float) {
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+  return (int32_t)(uint32_t)bits;
+}
+
+/* Write the fields of r that its type carries to out (BINARY_MAX_RECORD bytes are enough).
+   Returns the number of bytes written. */
+static inline int binaryEncode(unsigned char *out, const struct binary_record *r) {
+  int is_float = calcOpIsFloat(r->op);
+
+  out[0] = r->type;
+  out[1] = r->op;
+  if (r->type == BINARY_ASSIGNMENT) {
+    binaryPutValue(out + 2, is_float, r->value1);
+    binaryPutValue(out + 2 + (is_float ? 8 : 4), is_float, r->value2);
+  } else if (r->type == BINARY_ANSWER) {
+    binaryPutValue(out + 2, is_float, r->result);
+  }
+  return binaryRecordSize(r->type, r->op);
+}
+
+/* Read one record from the len bytes at in. Returns 0 if the type or op is out of range or the
+   record is not len bytes long. */
+static inline int binaryDecode(const unsigned char *in, int len, struct binary_record *r) {
+  if (len < BINARY_HEADER_SIZE) {
+    return 0;
+  }
+
+  r->type = in[0];
+  r->op = in[1];
+  if (binaryRecordSize(r->type, r->op) != len) {
+    return 0;
+  }
+
+  int is_float = calcOpIsFloat(r->op);
+  r->value1 = 0;
+  r->value2 = 0;
+  r->result = 0;
+  if (r->type == BINARY_ASSIGNMENT) {
+    r->value1 = binaryGetValue(in + 2, is_float);
+    r->value2 = binaryGetValue(in + 2 + (is_float ? 8 : 4), is_float);
+  } else if (r->type == BINARY_ANSWER) {
+    r->result = binaryGetValue(in + 2, is_float);
+  }
+  return 1;
+}
+
+/* Next complete record in a line buffer. A header with an unknown type or op comes back as a
+   block of just the header, which binaryDecode() then rejects. */
+template <size_t N> static inline bool binaryNextRecord(line_buffer<N> *r, std::string_view *block) {
+  if (r->end - r->start < BINARY_HEADER_SIZE) {
+    return false;
+  }
+
+  const unsigned char *header = (const unsigned char *)r->buf + r->start;
+  int size = binaryRecordSize(header[0], header[1]);
+  return lineReaderNextBlock(r, size > 0 ? size : BINARY_HEADER_SIZE, block);
+}
+
+#endif
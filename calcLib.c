@@ -9,17 +9,349 @@
    
 */ 
 #include "calcLib.h"
+#include "calcOps.h"
 
 
-/* array of char* that points to char arrays.  */ 
-char *arith[]={"add","div","mul","sub","fadd","fdiv","fmul","fsub"};
+/* array of char* that points to char arrays, one per operator in calcOps.h, in the order of enum calc_op.  */ 
+char *arith[]={ CALC_OPS(CALC_OP_NAME) };
 
-/* Used for random number */
-time_t myData_seedValue;
+/* Used for random number. Each thread has its own default generator, so threads never share (or lock) 
+   it, and a thread seeded with a fixed value always gets the same sequence. */
+__thread time_t myData_seedValue;
+__thread calc_rng_t myData_rng;
+__thread int myData_seeded;
+
+
+static unsigned long long rotl(const unsigned long long x, int k){
+  return (x << k) | (x >> (64 - k));
+}
+
+static unsigned long long nextRandom(calc_rng_t *rng){
+  /* xoshiro256** by Blackman and Vigna, see https://prng.di.unimi.it/ . Fast, 256 bits of state and 
+     good enough statistics for anything we do here (still NOT for cryptography). */
+  unsigned long long *s=rng->s;
+  const unsigned long long result=rotl(s[1]*5, 7)*9;
+  const unsigned long long t=s[1] << 17;
+
+  s[2]^=s[0];
+  s[3]^=s[1];
+  s[1]^=s[2];
+  s[0]^=s[3];
+  s[2]^=t;
+  s[3]=rotl(s[3], 45);
+
+  return(result);
+}
+
+static unsigned int randomBelow(calc_rng_t *rng, unsigned int n){
+  /* Scale the top 32 bits into [0,n) with a multiply and a shift instead of a modulo. */
+  return((unsigned int)(((nextRandom(rng) >> 32) * n) >> 32));
+}
+
+int initCalcLib_r(calc_rng_t *rng, unsigned long long seed){
+  /* Spread the seed over the whole state with splitmix64, as recommended for xoshiro. This also makes
+     sure the state is never all zeros, which xoshiro could not get out of. */
+  int i;
+  for(i=0;i<4;i++){
+    unsigned long long z=(seed+=0x9e3779b97f4a7c15ULL);
+    z=(z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z=(z ^ (z >> 27))*0x94d049bb133111ebULL;
+    rng->s[i]=z ^ (z >> 31);
+  }
+  return(0);
+}
+
+int randomOp_r(calc_rng_t *rng){
+  int Listitems=sizeof(arith)/(sizeof(char*)); 
+  /* Figure out HOW many entries there are in the list.
+     First we get the total size that the array of pointers use, sizeof(arith). Then we divide with 
+     the size of a pointer (sizeof(char*)), this gives us the number of pointers in the list. 
+  */
+  int itemPos=randomBelow(rng, Listitems);
+  /* As we know the number of items, we can just draw a random number between 0 and the number 
+     of items in the list. That position is the operator code.
+  */
+  return(itemPos);
+}
+
+char *randomType_r(calc_rng_t *rng){
+  int itemPos=randomOp_r(rng);
+  /* Using the operator code, we just return the string found at that position arith[itemPos]; */
+  return(arith[itemPos]);
+}
+
+int randomInt_r(calc_rng_t *rng){
+  /* A random integer between 0 and 99. */
+  return(randomBelow(rng, 100));
+}
+
+double randomFloat_r(calc_rng_t *rng){
+  /* The top 53 bits give a double in [0,1) with every bit random, then scale it to [0,100). */
+  double x=(double)(nextRandom(rng) >> 11)*(1.0/9007199254740992.0)*100.0;
+  return(x);
+}
+
+
+int opCount(void){
+  return(sizeof(arith)/(sizeof(char*)));
+}
+
+char *opName(int op){
+  return(arith[op]);
+}
+
+int opIsFloat(int op){
+  return((CALC_FLOAT_MASK >> op) & 1);
+}
+
+/* Batch generation. Every assignment takes three draws from one lane: the operator from the first 
+   (scaled into [0,CALC_OP_COUNT) like randomBelow() does), and one operand from each of the other two. 
+   Each lane makes one assignment per step, so the four lanes make four assignments at a time. */
+
+#define BATCH_LANES 4
+#define EXP_ONE 0x3FF0000000000000ULL
+
+static int batchSimd=1;
+
+int initCalcBatch_r(calc_batch_rng_t *rng, unsigned long long seed){
+  int lane, word;
+  calc_rng_t one;
+  for(lane=0;lane<BATCH_LANES;lane++){
+    initCalcLib_r(&one, seed + lane*0x632be59bd9b4e019ULL);
+    for(word=0;word<4;word++){
+      rng->s[word][lane]=one.s[word];
+    }
+  }
+  return(0);
+}
+
+static double batchInt(unsigned long long x, unsigned long long n, unsigned long long base){
+  return((double)(base + (((x >> 32)*n) >> 32)));
+}
+
+static double batchFloat(unsigned long long x){
+  /* Put 52 random bits in the mantissa of a double in [1,2), which needs no int to double conversion. */
+  union { unsigned long long u; double d; } v;
+  v.u=(x >> 12) | EXP_ONE;
+  return((v.d-1.0)*100.0);
+}
+
+static void randomAssignmentsScalar(calc_batch_rng_t *rng, int count, int *ops, double *operands){
+  /* One lane at a time: lane l makes assignments l, l+4, l+8, ... As in the SIMD version every lane 
+     takes the same number of steps, also when count is not a multiple of four. */
+  int steps=(count+BATCH_LANES-1)/BATCH_LANES;
+  int lane, step, word;
+  for(lane=0;lane<BATCH_LANES;lane++){
+    calc_rng_t one;
+    for(word=0;word<4;word++){
+      one.s[word]=rng->s[word][lane];
+    }
+    for(step=0;step<steps;step++){
+      int i=step*BATCH_LANES+lane;
+      int op=(int)(((nextRandom(&one) >> 32)*CALC_OP_COUNT) >> 32);
+      unsigned long long x1=nextRandom(&one);
+      unsigned long long x2=nextRandom(&one);
+      if(i>=count){
+        continue;
+      }
+      ops[i]=op;
+      if((CALC_FLOAT_MASK >> op) & 1){
+        operands[2*i]=batchFloat(x1);
+        operands[2*i+1]=batchFloat(x2);
+      } else {
+        operands[2*i]=batchInt(x1, 100, 0);
+        operands[2*i+1]=(op==CALC_DIV) ? batchInt(x2, 99, 1) : batchInt(x2, 100, 0);
+      }
+    }
+    for(word=0;word<4;word++){
+      rng->s[word][lane]=one.s[word];
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static __m256i rotl4(__m256i x, int k){
+  return(_mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - k)));
+}
+
+AVX2 static __m256i next4(__m256i s[4]){
+  /* xoshiro256** on four lanes. AVX2 has no 64 bit multiply, but *5 and *9 are a shift and an add. */
+  __m256i s1x5=_mm256_add_epi64(_mm256_slli_epi64(s[1], 2), s[1]);
+  __m256i r=rotl4(s1x5, 7);
+  __m256i result=_mm256_add_epi64(_mm256_slli_epi64(r, 3), r);
+  __m256i t=_mm256_slli_epi64(s[1], 17);
+
+  s[2]=_mm256_xor_si256(s[2], s[0]);
+  s[3]=_mm256_xor_si256(s[3], s[1]);
+  s[1]=_mm256_xor_si256(s[1], s[2]);
+  s[0]=_mm256_xor_si256(s[0], s[3]);
+  s[2]=_mm256_xor_si256(s[2], t);
+  s[3]=rotl4(s[3], 45);
+
+  return(result);
+}
+
+AVX2 static __m256d int4(__m256i x, long long n, long long base){
+  /* base + ((x >> 32)*n >> 32), then to double by adding 2^52 in the integer domain and subtracting it 
+     as a double, which works for any value below 2^52. */
+  __m256i v=_mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), _mm256_set1_epi64x(n)), 32);
+  v=_mm256_add_epi64(v, _mm256_set1_epi64x(base));
+  __m256d magic=_mm256_set1_pd(4503599627370496.0);
+  return(_mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(v, _mm256_castpd_si256(magic))), magic));
+}
+
+AVX2 static __m256d float4(__m256i x){
+  __m256i bits=_mm256_or_si256(_mm256_srli_epi64(x, 12), _mm256_set1_epi64x(EXP_ONE));
+  return(_mm256_mul_pd(_mm256_sub_pd(_mm256_castsi256_pd(bits), _mm256_set1_pd(1.0)), _mm256_set1_pd(100.0)));
+}
+
+AVX2 static void randomAssignmentsAvx2(calc_batch_rng_t *rng, int count, int *ops, double *operands){
+  __m256i s[4];
+  int word, i;
+  for(word=0;word<4;word++){
+    s[word]=_mm256_loadu_si256((__m256i *)rng->s[word]);
+  }
+
+  for(i=0;i<count;i+=BATCH_LANES){
+    __m256i op=_mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(next4(s), 32), _mm256_set1_epi64x(CALC_OP_COUNT)), 32);
+    __m256i x1=next4(s);
+    __m256i x2=next4(s);
+
+    /* Bit op of the float mask, moved to bit 0 and widened to a whole lane */
+    __m256i float_bit=_mm256_and_si256(_mm256_srlv_epi64(_mm256_set1_epi64x(CALC_FLOAT_MASK), op), _mm256_set1_epi64x(1));
+    __m256i is_float=_mm256_sub_epi64(_mm256_setzero_si256(), float_bit);
+    __m256i is_div=_mm256_cmpeq_epi64(op, _mm256_set1_epi64x(CALC_DIV));
+
+    __m256d v1=_mm256_blendv_pd(int4(x1, 100, 0), float4(x1), _mm256_castsi256_pd(is_float));
+    __m256d v2=_mm256_blendv_pd(int4(x2, 100, 0), int4(x2, 99, 1), _mm256_castsi256_pd(is_div));
+    v2=_mm256_blendv_pd(v2, float4(x2), _mm256_castsi256_pd(is_float));
+
+    /* Interleave to v1[0] v2[0] v1[1] v2[1] ... and pack the op codes down to 32 bits. */
+    __m256d lo=_mm256_unpacklo_pd(v1, v2);
+    __m256d hi=_mm256_unpackhi_pd(v1, v2);
+    __m128i op32=_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(op, _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6)));
+
+    if(count-i>=BATCH_LANES){
+      _mm256_storeu_pd(operands+2*i, _mm256_permute2f128_pd(lo, hi, 0x20));
+      _mm256_storeu_pd(operands+2*i+4, _mm256_permute2f128_pd(lo, hi, 0x31));
+      _mm_storeu_si128((__m128i *)(ops+i), op32);
+    } else {
+      int tail_ops[BATCH_LANES];
+      double tail_operands[2*BATCH_LANES];
+      _mm256_storeu_pd(tail_operands, _mm256_permute2f128_pd(lo, hi, 0x20));
+      _mm256_storeu_pd(tail_operands+4, _mm256_permute2f128_pd(lo, hi, 0x31));
+      _mm_storeu_si128((__m128i *)tail_ops, op32);
+      for(word=0;word<count-i;word++){
+        ops[i+word]=tail_ops[word];
+        operands[2*(i+word)]=tail_operands[2*word];
+        operands[2*(i+word)+1]=tail_operands[2*word+1];
+      }
+    }
+  }
+
+  for(word=0;word<4;word++){
+    _mm256_storeu_si256((__m256i *)rng->s[word], s[word]);
+  }
+}
+
+static int haveAvx2(void){
+  return(__builtin_cpu_supports("avx2"));
+}
+#else
+static int haveAvx2(void){
+  return(0);
+}
+#endif
+
+int calcBatchSimd(int enable){
+  batchSimd=enable;
+  return(enable && haveAvx2());
+}
+
+void randomAssignments_r(calc_batch_rng_t *rng, int count, int *ops, double *operands){
+#if defined(__x86_64__) || defined(__i386__)
+  if(batchSimd && haveAvx2()){
+    randomAssignmentsAvx2(rng, count, ops, operands);
+    return;
+  }
+#endif
+  randomAssignmentsScalar(rng, count, ops, operands);
+}
+
+/* Grading. An answer is correct if it is within GRADE_TOLERANCE of the reference result for float 
+   operators, or the same when both are truncated to int for integer ones. Results come back as a 
+   bitmask, 64 answers per word, so a caller can test one bit or skip whole words of OKs. */
+
+#define GRADE_TOLERANCE 0.0001
+
+static unsigned long long gradeWordScalar(int count, const double *expected, const double *answers, const unsigned char *is_float){
+  /* Up to 64 answers, bit i for answer i. */
+  unsigned long long bits=0;
+  int i;
+  for(i=0;i<count;i++){
+    int ok;
+    if(is_float[i]){
+      double diff=answers[i]-expected[i];
+      ok=(diff<0 ? -diff : diff) < GRADE_TOLERANCE;
+    } else {
+      ok=(int)answers[i]==(int)expected[i];
+    }
+    bits|=(unsigned long long)ok << i;
+  }
+  return(bits);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+AVX2 static unsigned long long gradeWordAvx2(const double *expected, const double *answers, const unsigned char *is_float){
+  /* 64 answers. Every one is graded both ways, four at a time, and the is_float bytes pick which 
+     verdict counts: the float test is a subtract, a clear of the sign bit and a compare, the 
+     integer test truncates both to int32 (as the (int) cast does) and compares. */
+  __m256d tolerance=_mm256_set1_pd(GRADE_TOLERANCE);
+  __m256d sign=_mm256_set1_pd(-0.0);
+  unsigned long long float_bits=0, int_bits=0, float_mask;
+  int i;
+
+  __m256i zero=_mm256_setzero_si256();
+  unsigned int low=_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)is_float), zero));
+  unsigned int high=_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(is_float+32)), zero));
+  float_mask=~((unsigned long long)high << 32 | low);
+
+  for(i=0;i<64;i+=4){
+    __m256d e=_mm256_loadu_pd(expected+i);
+    __m256d a=_mm256_loadu_pd(answers+i);
+    __m256d diff=_mm256_andnot_pd(sign, _mm256_sub_pd(a, e));
+    __m128i same=_mm_cmpeq_epi32(_mm256_cvttpd_epi32(a), _mm256_cvttpd_epi32(e));
+
+    float_bits|=(unsigned long long)_mm256_movemask_pd(_mm256_cmp_pd(diff, tolerance, _CMP_LT_OQ)) << i;
+    int_bits|=(unsigned long long)_mm_movemask_ps(_mm_castsi128_ps(same)) << i;
+  }
+  return((float_bits & float_mask) | (int_bits & ~float_mask));
+}
+#endif
+
+void gradeAnswers(int count, const double *expected, const double *answers, const unsigned char *is_float, unsigned long long *correct){
+  int i=0;
+#if defined(__x86_64__) || defined(__i386__)
+  if(batchSimd && haveAvx2()){
+    for(;i+64<=count;i+=64){
+      correct[i/64]=gradeWordAvx2(expected+i, answers+i, is_float+i);
+    }
+  }
+#endif
+  for(;i<count;i+=64){
+    int n=count-i < 64 ? count-i : 64;
+    correct[i/64]=gradeWordScalar(n, expected+i, answers+i, is_float+i);
+  }
+}
 
 int initCalcLib(void){
   /* Init the random number generator with a seed, based on the current time--> should be randomish each time called */
-  srand((unsigned) time(&myData_seedValue));
+  initCalcLib_r(&myData_rng, (unsigned long long) time(&myData_seedValue));
+  myData_seeded=1;
   return(0);
 }
 
@@ -30,44 +362,37 @@ int initCalcLib_seed(unsigned int seed){
 
      This is 'messy' for more details see https://en.wikipedia.org/wiki/Pseudorandom_number_generator. 
 
-     DO NOT USE rand() for production, wher you NEED good random numbers. 
+     DO NOT USE this for production, wher you NEED good random numbers (for instance keys). 
   */
   
   myData_seedValue=seed;
-  srand(seed);
+  initCalcLib_r(&myData_rng, seed);
+  myData_seeded=1;
   return(0);
 }
+
+static calc_rng_t *defaultRng(void){
+  if(!myData_seeded){
+    initCalcLib_seed(1);
+  }
+  return(&myData_rng);
+}
   
 char *randomType(void){
-  int Listitems=sizeof(arith)/(sizeof(char*)); 
-  /* Figure out HOW many entries there are in the list.
-     First we get the total size that the array of pointers use, sizeof(arith). Then we divide with 
-     the size of a pointer (sizeof(char*)), this gives us the number of pointers in the list. 
-  */
-  int itemPos=rand() % Listitems;
-  /* As we know the number of items, we can just draw a random number and modulo it with the number 
-     of items in the list, then we will get a random number between 0 and the number of items in the list 
-     
-     Using that information, we just return the string found at that position arith[itemPos];
-  */
-  return(arith[itemPos]);
-  
+  return(randomType_r(defaultRng()));
 };
 
 
-int randomInt(void){
-  /* Draw a random interger between o and RAND_MAX, then modulo this with 100 to get a random 
-     number between 0 and 100. */
-  
-  return( rand()%100 );
+int randomOp(void){
+  return(randomOp_r(defaultRng()));
 };
 
 
-double randomFloat(void){
-  /* The same as for the interber, but for a double, and without the modulo. We cant use 
-     the module approach as it would generate integers, which we do not want. */
-  double x = (double)rand()/(double)(RAND_MAX/100.0);
-  return(x);
+int randomInt(void){
+  return(randomInt_r(defaultRng()));
 };
 
 
+double randomFloat(void){
+  return(randomFloat_r(defaultRng()));
+};
@@ -20,12 +20,55 @@ Implementation in calcLib.c
 */
   
 
+  /* 
+     Generator state for the reentrant _r functions (xoshiro256**). Each owner (a thread, a server 
+     worker, ...) keeps its own, so nothing is shared or locked, and the same seed always gives 
+     the same sequence. 
+  */
+  typedef struct {
+    unsigned long long s[4];
+  } calc_rng_t;
+
+  int initCalcLib_r(calc_rng_t *rng, unsigned long long seed); // Init <rng> from <seed>. 
+  char* randomType_r(calc_rng_t *rng); // As randomType(), drawing from <rng>. 
+  int randomOp_r(calc_rng_t *rng); // As randomOp(), drawing from <rng>. 
+  int randomInt_r(calc_rng_t *rng); // As randomInt(), drawing from <rng>. 
+  double randomFloat_r(calc_rng_t *rng); // As randomFloat(), drawing from <rng>. 
+
+  /* 
+     Batch generation. calc_batch_rng_t runs four xoshiro256** generators side by side (state word 
+     by lane), so that with AVX2 one instruction steps all four. Each call fills whole arrays, which 
+     saves the three calls and the string compares per assignment. Operator codes are positions in 
+     the operator list (enum calc_op in calcOps.h), opName() turns one into its string. The output is the same with and without 
+     AVX2, but it is a different sequence than the per-call functions give for the same seed. 
+  */
+  typedef struct {
+    unsigned long long s[4][4];
+  } calc_batch_rng_t;
+
+  int initCalcBatch_r(calc_batch_rng_t *rng, unsigned long long seed); // Init <rng> from <seed>. 
+  /* Fill ops[0..count-1] with operator codes and operands[0..2*count-1] with the two operands of each 
+     assignment (integers 0..99 as doubles for integer operators, 0.0 to 100.0 for float ones). Integer 
+     division never gets a zero divisor. */
+  void randomAssignments_r(calc_batch_rng_t *rng, int count, int *ops, double *operands);
+  int opCount(void); // Number of operators. 
+  char* opName(int op); // String of operator code <op>. 
+  int opIsFloat(int op); // 1 if <op> takes float operands. 
+  /* Grade answers[0..count-1] against the reference results expected[0..count-1]: bit i%64 of correct[i/64] 
+     is set if answer i is right, that is within 0.0001 when is_float[i] is non-zero, or equal when both are 
+     truncated to int when it is zero. correct needs (count+63)/64 words. Grades 64 answers per step with AVX2. */
+  void gradeAnswers(int count, const double *expected, const double *answers, const unsigned char *is_float, unsigned long long *correct);
+  int calcBatchSimd(int enable); // Allow (1) or forbid (0) AVX2 in the batch functions, returns 1 if it will be used. 
+
+  /* The functions below use a default calc_rng_t, one per thread. A thread that never calls an init
+     function draws as if it had called initCalcLib_seed(1). */
   int initCalcLib(void); // Init internal variables to the library, if needed. 
   int initCalcLib_seed(unsigned int seed); // Init internal variables to the library, use <seed> for specific variable. 
 
   char* randomType(void); // Return a string to an mathematical operator
-  int randomInt(void);// Return a random integer, between 0 and 100. 
-  double randomFloat(void);// Return a random float between 0.0 and 100.0
+  int randomOp(void); // Return the code of a mathematical operator (enum calc_op in calcOps.h), the same draw as randomType() 
+  int randomInt(void);// Return a random integer, between 0 and 99. 
+  double randomFloat(void);// Return a random float between 0.0 and 100.0 (not included)
 
 
 #endif
@@ -0,0 +1,133 @@
+#ifndef __CALC_OPS
+#define __CALC_OPS
+
+/*
+
+  The arithmetic operators, in one place.
+
+  CALC_OPS lists every operator once: its code, the name that goes over the wire, whether it takes
+  float operands, and how to evaluate it on a and b. Everything else is generated from the list:
+  the calc_op enum (the operator code, also the position in calcLib's arith[] and the op byte of
+  BINARY TCP), calcLib's name list, and for C++ the calc_ops[] table with the name, the operand
+  formatter and the evaluation function of each operator, plus calcOpLookup() to turn a name from
+  the wire back into a code. Adding an operator is one more line here.
+
+  Integer operators evaluate on long long, so a and b are whole numbers and division truncates;
+  a zero divisor gives 0 rather than SIGFPE. Float operators evaluate on double.
+
+*/
+
+#define CALC_OPS(X)                    \
+  X(ADD,  "add",  0, a + b)            \
+  X(DIV,  "div",  0, b != 0 ? a / b : 0) \
+  X(MUL,  "mul",  0, a * b)            \
+  X(SUB,  "sub",  0, a - b)            \
+  X(FADD, "fadd", 1, a + b)            \
+  X(FDIV, "fdiv", 1, a / b)            \
+  X(FMUL, "fmul", 1, a * b)            \
+  X(FSUB, "fsub", 1, a - b)
+
+#define CALC_OP_ENUM(code, name, is_float, expr) CALC_##code,
+#define CALC_OP_NAME(code, name, is_float, expr) name,
+#define CALC_OP_FLOAT_BIT(code, name, is_float, expr) | ((unsigned long long)(is_float) << CALC_##code)
+
+enum calc_op { CALC_OPS(CALC_OP_ENUM) CALC_OP_COUNT };
+
+/* Bit op is set for the operators that take floats. */
+#define CALC_FLOAT_MASK (0 CALC_OPS(CALC_OP_FLOAT_BIT))
+
+#ifdef __cplusplus
+
+#include <string_view>
+#include <type_traits>
+
+#include "numCodec.h"
+
+struct calc_op_info {
+  const char *name;
+  int name_len;
+  int is_float;
+  int (*format)(char *out, double v); // an operand or result, as it goes over the wire
+  double (*eval)(double a, double b);
+};
+
+/* Integer operands and results are sent as "%d". */
+static inline int calcFormatInt(char *out, double v) {
+  return formatInt(out, (long long)v);
+}
+
+#define CALC_OP_EVAL(code, name, is_float, expr)                   \
+  static constexpr double calcEval##code(double x, double y) {     \
+    typedef std::conditional_t<is_float, double, long long> T;     \
+    T a = (T)x;                                                    \
+    T b = (T)y;                                                    \
+    return (double)(expr);                                         \
+  }
+CALC_OPS(CALC_OP_EVAL)
+#undef CALC_OP_EVAL
+
+#define CALC_OP_INFO(code, name, is_float, expr) \
+  {name, sizeof(name) - 1, is_float, is_float ? formatG8 : calcFormatInt, calcEval##code},
+static constexpr calc_op_info calc_ops[CALC_OP_COUNT] = {CALC_OPS(CALC_OP_INFO)};
+#undef CALC_OP_INFO
+
+static inline int calcOpIsFloat(int op) {
+  return (CALC_FLOAT_MASK >> op) & 1;
+}
+
+/* The reference result of op on a and b. */
+static inline double calcEval(int op, double a, double b) {
+  return calc_ops[op].eval(a, b);
+}
+
+/*
+   Name lookup: a hash of the first two characters and the length picks the only operator that
+   can match, one compare confirms it. The table is built at compile time, and the build fails
+   if two operators ever share a slot.
+*/
+#define CALC_LOOKUP_SLOTS 32
+
+static constexpr unsigned calcNameHash(const char *name, size_t len) {
+  return ((unsigned char)name[0] + (len > 1 ? (unsigned char)name[1] * 3 : 0) + len) & (CALC_LOOKUP_SLOTS - 1);
+}
+
+struct calc_lookup_table {
+  signed char slots[CALC_LOOKUP_SLOTS];
+  bool perfect;
+};
+
+static constexpr calc_lookup_table calcBuildLookup() {
+  calc_lookup_table t = {};
+  t.perfect = true;
+  for (int i = 0; i < CALC_LOOKUP_SLOTS; i++) {
+    t.slots[i] = -1;
+  }
+  for (int op = 0; op < CALC_OP_COUNT; op++) {
+    unsigned h = calcNameHash(calc_ops[op].name, calc_ops[op].name_len);
+    if (t.slots[h] != -1) {
+      t.perfect = false;
+    }
+    t.slots[h] = op;
+  }
+  return t;
+}
+
+static constexpr calc_lookup_table calc_lookup = calcBuildLookup();
+static_assert(calc_lookup.perfect, "two operator names hash to the same slot, change calcNameHash()");
+
+/* Operator code of name, or -1 if it is not an operator. */
+static inline int calcOpLookup(std::string_view name) {
+  if (name.empty()) {
+    return -1;
+  }
+
+  int op = calc_lookup.slots[calcNameHash(name.data(), name.size())];
+  if (op < 0 || name != std::string_view(calc_ops[op].name, calc_ops[op].name_len)) {
+    return -1;
+  }
+  return op;
+}
+
+#endif
+
+#endif
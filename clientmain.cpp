@@ -3,127 +3,273 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/resource.h>
 
 #include <calcLib.h>
+#include "calcOps.h"
+#include "numCodec.h"
+#include "lineReader.h"
+#include "binaryProtocol.h"
+#include "textProtocol.h"
 
 using namespace std;
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        cout << "Usage: ./client <host:port>" << endl;
-        return 1;
+#define MAX_PIPELINE 256 // Most assignments the server hands out on one TEXT TCP 1.1 connection
+
+// TEXT UDP 1.0, see servermain.cpp. The request is padded so the reply is never bigger than it.
+#define UDP_REQUEST "TEXT UDP 1.0\n"
+#define UDP_REQUEST_MIN 96
+#define UDP_DATAGRAM_MAX 512
+
+// Which protocol to speak when the server offers several
+enum protocol_choice { PROTOCOL_AUTO, PROTOCOL_TEXT, PROTOCOL_BINARY };
+
+// Read one line from the server, without the '\n'. Returns false if the connection failed first.
+// The line points into the reader's buffer and is valid until the next call.
+static bool readLine(line_reader *reader, int client_socket, string_view &line) {
+    while (!lineReaderNext(reader, &line)) {
+        if (lineReaderFill(reader, client_socket) <= 0) {
+            return false;
+        }
     }
+    return true;
+}
+
+// Read one BINARY TCP record from the server. Returns false if the connection failed first or the
+// record is not valid.
+static bool readRecord(line_reader *reader, int client_socket, binary_record &record) {
+    string_view block;
     
-    // Split the input into host and port parts
-    string input = argv[1];
-    
+    while (!binaryNextRecord(reader, &block)) {
+        if (lineReaderFill(reader, client_socket) <= 0) {
+            return false;
+        }
+    }
+    return binaryDecode((const unsigned char *)block.data(), block.size(), &record);
+}
+
+static double monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Connecting, after RFC 8305 ("Happy Eyeballs"): the addresses of the server are tried in
+// parallel rather than one after the other, each CONNECT_DELAY_MS after the one before or as soon
+// as it fails, alternating between IPv6 and IPv4. The first connection to come up is kept and the
+// others are closed, so an address that does not answer costs CONNECT_DELAY_MS instead of a whole
+// connect timeout.
+#define CONNECT_DELAY_MS 250
+#define CONNECT_TIMEOUT_MS 10000 // Give up when no address has answered for this long
+
+struct server_address {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+};
+
+// Resolved addresses, for the whole run. A client that opens one connection per assignment or
+// per load session looks the server up once. The address that connected last goes first.
+struct resolved_server {
     string hostname;
     string port_string;
-    
-    // Check if this is IPv6 format with brackets like [::1]:5000
-    if (input[0] == '[') {
-        size_t bracket_end = input.find(']');
-        if (bracket_end == string::npos || bracket_end + 1 >= input.length() || input[bracket_end + 1] != ':') {
-            cout << "Invalid bracketed IPv6 format" << endl;
-            return 1;
-        }
-        hostname = input.substr(1, bracket_end - 1);
-        port_string = input.substr(bracket_end + 2);
-    } else {
-        // Find the last colon for host:port splitting
-        size_t colon_pos = input.rfind(':');
-        if (colon_pos == string::npos) {
-            cout << "Invalid host:port format" << endl;
-            return 1;
+    int socktype;
+    vector<server_address> addresses;
+};
+
+static vector<resolved_server> resolved_servers;
+
+// The addresses of hostname:port_string in the order to try them, or NULL if it does not resolve.
+static vector<server_address> *resolveServer(const string &hostname, const string &port_string, int socktype) {
+    for (resolved_server &r : resolved_servers) {
+        if (r.hostname == hostname && r.port_string == port_string && r.socktype == socktype) {
+            return &r.addresses;
         }
-        
-        hostname = input.substr(0, colon_pos);
-        port_string = input.substr(colon_pos + 1);
     }
     
-    cout << "Host " << hostname << ", and port " << port_string << "." << endl;
-    
     // Get address info to support both IPv4 and IPv6
     struct addrinfo hints;
     struct addrinfo *result;
     
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC;    // Allow both IPv4 and IPv6
-    hints.ai_socktype = SOCK_STREAM;
-    
-    int addr_result = getaddrinfo(hostname.c_str(), port_string.c_str(), &hints, &result);
+    hints.ai_socktype = socktype;
     
-    if (addr_result != 0) {
+    if (getaddrinfo(hostname.c_str(), port_string.c_str(), &hints, &result) != 0) {
         cout << "ERROR: RESOLVE ISSUE" << endl;
-        return 1;
+        return NULL;
+    }
+    
+    // Keep the resolver's order within each family, but alternate the families, starting with
+    // the one it put first
+    vector<server_address> first_family;
+    vector<server_address> other_family;
+    
+    for (struct addrinfo *current_addr = result; current_addr != NULL; current_addr = current_addr->ai_next) {
+        server_address a;
+        memcpy(&a.addr, current_addr->ai_addr, current_addr->ai_addrlen);
+        a.addrlen = current_addr->ai_addrlen;
+        if (current_addr->ai_family == result->ai_family) {
+            first_family.push_back(a);
+        } else {
+            other_family.push_back(a);
+        }
+    }
+    freeaddrinfo(result);
+    
+    resolved_server r;
+    r.hostname = hostname;
+    r.port_string = port_string;
+    r.socktype = socktype;
+    for (size_t i = 0; i < max(first_family.size(), other_family.size()); i++) {
+        if (i < first_family.size()) {
+            r.addresses.push_back(first_family[i]);
+        }
+        if (i < other_family.size()) {
+            r.addresses.push_back(other_family[i]);
+        }
     }
     
-    // Try connecting to each resolved address until one works
+    resolved_servers.push_back(r);
+    return &resolved_servers.back().addresses;
+}
+
+// Connect to one of the addresses, racing them as described above. Returns the connected socket,
+// still non-blocking, and moves its address to the front. Returns -1 if none connected.
+static int raceConnect(vector<server_address> &addresses, int socktype) {
+    vector<struct pollfd> pending;  // connects in progress
+    vector<size_t> pending_address; // index into addresses of each
+    size_t next = 0;
+    double now = monotonicMs();
+    double next_start = now;
+    double deadline = now + CONNECT_TIMEOUT_MS;
     int client_socket = -1;
-    struct addrinfo *current_addr;
+    size_t winner = 0;
     
-    for (current_addr = result; current_addr != NULL; current_addr = current_addr->ai_next) {
+    while (client_socket < 0 && now < deadline) {
+        if (next < addresses.size() && (now >= next_start || pending.empty())) {
+            server_address &a = addresses[next];
+            int fd = socket(a.addr.ss_family, socktype | SOCK_NONBLOCK, 0);
+            
+            next_start = now + CONNECT_DELAY_MS;
+            if (fd < 0) {
+                next_start = now; // This address didn't work, try the next one
+            } else if (connect(fd, (struct sockaddr *)&a.addr, a.addrlen) == 0) {
+                client_socket = fd; // Right away, as with SOCK_DGRAM
+                winner = next;
+            } else if (errno == EINPROGRESS) {
+                pending.push_back({fd, POLLOUT, 0});
+                pending_address.push_back(next);
+            } else {
+                close(fd);
+                next_start = now;
+            }
+            next++;
+            continue;
+        }
         
-        client_socket = socket(current_addr->ai_family, current_addr->ai_socktype, current_addr->ai_protocol);
+        if (pending.empty()) {
+            break; // Every address failed
+        }
         
-        if (client_socket < 0) {
+        double wait_until = next < addresses.size() ? min(next_start, deadline) : deadline;
+        int n = poll(pending.data(), pending.size(), (int)(wait_until - now) + 1);
+        now = monotonicMs();
+        if (n <= 0) {
             continue;
         }
         
-        if (connect(client_socket, current_addr->ai_addr, current_addr->ai_addrlen) == 0) {
-            break; // Connected successfully!
+        for (size_t i = 0; i < pending.size(); i++) {
+            if (pending[i].revents == 0) {
+                continue;
+            }
+            
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) {
+                client_socket = pending[i].fd;
+                winner = pending_address[i];
+                pending.erase(pending.begin() + i);
+                break;
+            }
+            
+            // Failed, don't wait out the delay before the next address
+            close(pending[i].fd);
+            pending.erase(pending.begin() + i);
+            pending_address.erase(pending_address.begin() + i);
+            next_start = now;
+            i--;
         }
-        
-        // This address didn't work, try the next one
-        close(client_socket);
-        client_socket = -1;
     }
     
-    freeaddrinfo(result);
+    // The attempts that lost
+    for (struct pollfd &p : pending) {
+        close(p.fd);
+    }
+    
+    if (client_socket >= 0 && winner > 0) {
+        server_address a = addresses[winner];
+        addresses.erase(addresses.begin() + winner);
+        addresses.insert(addresses.begin(), a);
+    }
+    return client_socket;
+}
+
+// Connect to the server. Returns the socket or -1.
+// With SOCK_DGRAM this only fixes the peer, so send() and recv() can be used.
+static int connectToServer(const string &hostname, const string &port_string, int socktype = SOCK_STREAM) {
+    vector<server_address> *addresses = resolveServer(hostname, port_string, socktype);
+    
+    if (addresses == NULL) {
+        return -1;
+    }
+    
+    int client_socket = raceConnect(*addresses, socktype);
     
     if (client_socket < 0) {
         cout << "ERROR: CANT CONNECT TO " << hostname << endl;
-        return 1;
+        return -1;
     }
     
+    // Blocking from here on
+    fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) & ~O_NONBLOCK);
+    
     // Set timeout so we don't wait forever
     struct timeval timeout;
     timeout.tv_sec = 5;
     timeout.tv_usec = 0;
     setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
     
-    // Read protocol line from server
-    string first_line = "";
-    char c;
-    while (true) {
-        int bytes_read = recv(client_socket, &c, 1, 0);
-        
-        if (bytes_read <= 0) {
-            cout << "ERROR: MISSMATCH PROTOCOL" << endl;
-            close(client_socket);
-            return 1;
-        }
-        
-        if (c == '\n') {
-            break;
-        }
-        
-        first_line = first_line + c;
-    }
+    return client_socket;
+}
+
+// Read the protocol lines up to the empty line. Returns false if TEXT TCP 1.0 is not offered.
+static bool readGreeting(line_reader *reader, int client_socket, bool &offers_pipelining, bool &offers_binary) {
+    string_view first_line;
+    
+    offers_pipelining = false;
+    offers_binary = false;
     
     // Make sure server supports our protocol
-    if (first_line != "TEXT TCP 1.0") {
-        cout << "ERROR: MISSMATCH PROTOCOL" << endl;
-        close(client_socket);
-        return 1;
+    if (!readLine(reader, client_socket, first_line) || first_line != "TEXT TCP 1.0") {
+        cout << (first_line == "ERROR BUSY" ? "ERROR: SERVER BUSY" : "ERROR: MISSMATCH PROTOCOL") << endl;
+        return false;
     }
     
     // Read remaining protocol lines until empty line
@@ -131,30 +277,61 @@ int main(int argc, char *argv[]) {
     int lines_read = 0;
     
     while (lines_read < max_protocol_lines) {
-        string protocol_line = "";
+        string_view protocol_line;
         
-        while (true) {
-            int bytes_read = recv(client_socket, &c, 1, 0);
-            
-            if (bytes_read <= 0) {
-                break;
-            }
-            
-            if (c == '\n') {
-                break;
-            }
-            
-            protocol_line = protocol_line + c;
-        }
+        readLine(reader, client_socket, protocol_line);
         
         // Empty line means we're done with protocol negotiation
         if (protocol_line.empty()) {
             break;
         }
         
+        if (protocol_line == "TEXT TCP 1.1") {
+            offers_pipelining = true;
+        } else if (protocol_line == "BINARY TCP 1.0") {
+            offers_binary = true;
+        }
+        
         lines_read++;
     }
     
+    return true;
+}
+
+// Parse "<op> <value1> <value2>" and work out the answer, result_string gets the line to send back.
+static bool solveAssignment(string_view assignment_line, string &result_string, bool show = true) {
+    assignment_fields fields;
+    
+    if (!splitAssignment(assignment_line, &fields)) {
+        if (show) {
+            cout << "Invalid assignment format" << endl;
+        }
+        return false;
+    }
+    
+    if (show) {
+        cout << "ASSIGNMENT: " << fields.operation << " " << fields.value1 << " " << fields.value2 << endl;
+    }
+    
+    // Do the math calculation, through the operator table
+    char answer[NUM_MAX_CHARS + 1];
+    result_string.assign(answer, answerAssignment(&fields, answer));
+    return true;
+}
+
+// Print the verdict next to our own answer
+static void showVerdict(string_view server_response, const string &result_string) {
+    // Clean up result for display
+    string display_result = result_string;
+    if (!display_result.empty() && display_result.back() == '\n') {
+        display_result.pop_back();
+    }
+    
+    cout << server_response << " (myresult=" << display_result << ")" << endl;
+}
+
+// One TEXT TCP 1.0 exchange on a connected socket, after the greeting
+static int runSession(line_reader *reader, int client_socket) {
     // Tell server we accept the protocol
     string ok_message = "OK\n";
     
@@ -162,144 +339,974 @@ int main(int argc, char *argv[]) {
     
     if (send_result <= 0) {
         cout << "Failed to send OK message" << endl;
-        close(client_socket);
         return 1;
     }
     
     // Get the math problem from server
-    string assignment_line = "";
+    string_view assignment_line;
+    
+    if (!readLine(reader, client_socket, assignment_line)) {
+        cout << "Failed to read assignment" << endl;
+        return 1;
+    }
+    
+    string result_string;
+    
+    if (!solveAssignment(assignment_line, result_string)) {
+        return 1;
+    }
+    
+    // Send answer back to server
+    int send_result2 = send(client_socket, result_string.c_str(), result_string.length(), 0);
+    
+    if (send_result2 <= 0) {
+        cout << "Failed to send result" << endl;
+        return 1;
+    }
+    
+    // Get server's response
+    string_view server_response;
+    
+    if (!readLine(reader, client_socket, server_response)) {
+        cout << "Failed to read server response" << endl;
+        return 1;
+    }
+    
+    showVerdict(server_response, result_string);
+    return 0;
+}
+
+// TEXT TCP 1.1: ask for count assignments, answer them all in one go, then collect the verdicts
+static int runPipelinedSession(line_reader *reader, int client_socket, int count) {
+    string request = "TEXT TCP 1.1 " + to_string(count) + "\n";
+    
+    if (send(client_socket, request.c_str(), request.length(), 0) <= 0) {
+        cout << "Failed to send protocol request" << endl;
+        return 1;
+    }
+    
+    vector<string> results(count);
+    string answers;
     
-    while (true) {
-        int bytes_read = recv(client_socket, &c, 1, 0);
+    for (int i = 0; i < count; i++) {
+        string_view assignment_line;
         
-        if (bytes_read <= 0) {
+        if (!readLine(reader, client_socket, assignment_line)) {
             cout << "Failed to read assignment" << endl;
-            close(client_socket);
             return 1;
         }
         
+        if (!solveAssignment(assignment_line, results[i])) {
+            return 1;
+        }
         
-        if (c == '\n') {
-            break;
+        answers += results[i];
+    }
+    
+    // Send every answer back without waiting for the verdicts
+    if (send(client_socket, answers.c_str(), answers.length(), 0) <= 0) {
+        cout << "Failed to send result" << endl;
+        return 1;
+    }
+    
+    int failed = 0;
+    
+    for (int i = 0; i < count; i++) {
+        string_view server_response;
+        
+        if (!readLine(reader, client_socket, server_response)) {
+            cout << "Failed to read server response" << endl;
+            return 1;
         }
         
-        assignment_line = assignment_line + c;
+        showVerdict(server_response, results[i]);
+        
+        if (server_response != "OK") {
+            failed = 1;
+        }
     }
     
-    // Parse the operation and two numbers
-    string operation;
-    string value1_string;
-    string value2_string;
+    return failed;
+}
+
+// A BINARY TCP value the way the text protocol would show it
+static string valueString(int op, double value) {
+    char buffer[NUM_MAX_CHARS];
     
-    int space1 = assignment_line.find(' ');
+    return string(buffer, calc_ops[op].format(buffer, value));
+}
+
+// BINARY TCP 1.0: count assignments as records, answered in one go like TEXT TCP 1.1
+static int runBinarySession(line_reader *reader, int client_socket, int count) {
+    string request = "BINARY TCP 1.0\n";
+    if (count > 1) {
+        request = "BINARY TCP 1.0 " + to_string(count) + "\n";
+    }
     
-    if (space1 == string::npos) {
-        cout << "Invalid assignment format" << endl;
-        close(client_socket);
+    if (send(client_socket, request.c_str(), request.length(), 0) <= 0) {
+        cout << "Failed to send protocol request" << endl;
         return 1;
     }
     
-    int space2 = assignment_line.find(' ', space1 + 1);
+    vector<unsigned char> answers(count * BINARY_MAX_RECORD);
+    size_t answers_len = 0;
+    vector<string> results(count);
     
-    if (space2 == string::npos) {
-        cout << "Invalid assignment format" << endl;
-        close(client_socket);
+    for (int i = 0; i < count; i++) {
+        binary_record record;
+        
+        if (!readRecord(reader, client_socket, record) || record.type != BINARY_ASSIGNMENT) {
+            cout << "Failed to read assignment" << endl;
+            return 1;
+        }
+        
+        cout << "ASSIGNMENT: " << calc_ops[record.op].name << " " << valueString(record.op, record.value1)
+             << " " << valueString(record.op, record.value2) << endl;
+        
+        record.type = BINARY_ANSWER;
+        record.result = calcEval(record.op, record.value1, record.value2);
+        answers_len += binaryEncode(&answers[answers_len], &record);
+        results[i] = valueString(record.op, record.result);
+    }
+    
+    // Send every answer back without waiting for the verdicts
+    if (send(client_socket, answers.data(), answers_len, 0) <= 0) {
+        cout << "Failed to send result" << endl;
+        return 1;
+    }
+    
+    int failed = 0;
+    
+    for (int i = 0; i < count; i++) {
+        binary_record verdict;
+        
+        if (!readRecord(reader, client_socket, verdict)) {
+            cout << "Failed to read server response" << endl;
+            return 1;
+        }
+        
+        if (verdict.type == BINARY_OK) {
+            showVerdict("OK", results[i]);
+        } else {
+            showVerdict(verdict.type == BINARY_TIMEOUT ? "ERROR TO" : "ERROR", results[i]);
+            failed = 1;
+        }
+    }
+    
+    return failed;
+}
+
+// The padded request datagram
+static string udpRequest() {
+    string request = UDP_REQUEST;
+    request.resize(UDP_REQUEST_MIN, '\0');
+    return request;
+}
+
+// Split a "<assignment>\n<cookie>\n" reply. Returns false if it does not look like one.
+static bool splitUdpReply(string_view reply, string_view &assignment_line, string_view &cookie) {
+    size_t newline = reply.find('\n');
+    
+    if (newline == string_view::npos || reply.empty() || reply.back() != '\n') {
+        return false;
+    }
+    
+    assignment_line = reply.substr(0, newline);
+    cookie = reply.substr(newline + 1, reply.size() - newline - 2);
+    return true;
+}
+
+// One TEXT UDP 1.0 exchange on a connected datagram socket
+static int runUdpExchange(int client_socket) {
+    string request = udpRequest();
+    
+    if (send(client_socket, request.data(), request.size(), 0) <= 0) {
+        cout << "Failed to send request" << endl;
         return 1;
     }
     
-    operation = assignment_line.substr(0, space1);
-    value1_string = assignment_line.substr(space1 + 1, space2 - space1 - 1);
-    value2_string = assignment_line.substr(space2 + 1);
+    char reply[UDP_DATAGRAM_MAX];
+    ssize_t reply_len = recv(client_socket, reply, sizeof(reply), 0);
+    string_view assignment_line;
+    string_view cookie;
     
-    cout << "ASSIGNMENT: " << operation << " " << value1_string << " " << value2_string << endl;
+    if (reply_len <= 0 || !splitUdpReply(string_view(reply, reply_len), assignment_line, cookie)) {
+        cout << "Failed to read assignment" << endl;
+        return 1;
+    }
     
-    // Do the math calculation
     string result_string;
     
-    // Check if this is a float operation (starts with 'f')
-    if (operation[0] == 'f') {
-        double value1 = atof(value1_string.c_str());
-        double value2 = atof(value2_string.c_str());
-        double result;
-        
-        if (operation == "fadd") {
-            result = value1 + value2;
-        } else if (operation == "fsub") {
-            result = value1 - value2;
-        } else if (operation == "fmul") {
-            result = value1 * value2;
-        } else if (operation == "fdiv") {
-            result = value1 / value2;
+    if (!solveAssignment(assignment_line, result_string)) {
+        return 1;
+    }
+    
+    // The cookie goes back with the answer, the server kept nothing
+    string answer = string(cookie) + "\n" + result_string;
+    
+    if (send(client_socket, answer.data(), answer.size(), 0) <= 0) {
+        cout << "Failed to send result" << endl;
+        return 1;
+    }
+    
+    char verdict[UDP_DATAGRAM_MAX];
+    ssize_t verdict_len = recv(client_socket, verdict, sizeof(verdict), 0);
+    
+    if (verdict_len <= 0) {
+        cout << "Failed to read server response" << endl;
+        return 1;
+    }
+    
+    string_view server_response(verdict, verdict_len);
+    if (server_response.back() == '\n') {
+        server_response.remove_suffix(1);
+    }
+    
+    showVerdict(server_response, result_string);
+    return server_response == "OK" ? 0 : 1;
+}
+
+/*
+   Load generator. Keeps a number of sessions in flight from one process with non-blocking
+   sockets and one epoll set, and starts a new session as soon as one finishes. Each session
+   runs the same exchange as above (BINARY TCP 1.0 when the server offers it, otherwise TEXT
+   TCP 1.1 when asked for more than one assignment and the server offers it), using
+   solveAssignment() or calcEval() for the math. With --udp every session is one TEXT UDP
+   1.0 exchange on its own datagram socket.
+
+   --stall MS plays a slow client, to test the server's deadlines: after picking the protocol a
+   session reads and answers nothing for MS, then carries on with whatever has arrived. With
+   --rcvbuf BYTES (SO_RCVBUF) the socket holds little of it, so the server's sends back up.
+*/
+
+#define LOAD_TIMEOUT_MS 10000 // Give up on a session that makes no progress for this long
+
+enum load_state { LOAD_CONNECTING, LOAD_GREETING, LOAD_ASSIGNMENT, LOAD_VERDICT };
+
+enum load_outcome { OUTCOME_OK, OUTCOME_ERROR, OUTCOME_TIMEOUT, OUTCOME_FAILED, OUTCOME_BUSY };
+
+struct load_session {
+    int fd;
+    load_state state;
+    bool first_line;          // still waiting for the first greeting line
+    bool offers_pipelining;
+    bool offers_binary;
+    bool pipelined;
+    bool binary;              // records instead of lines after the greeting
+    int count;                // assignments in this session
+    int lines;                // assignment or verdict lines read in the current state
+    load_outcome outcome;     // worst verdict so far
+    double started;           // ms
+    double last_progress;     // ms
+    double stalled_until;     // ms, --stall: not reading or answering until then, 0 when running
+    line_reader reader;
+    string answers;           // pipelined answers (lines or records) waiting to go out together
+};
+
+struct load_stats {
+    long ok = 0;
+    long error = 0;
+    long timeout = 0;
+    long failed = 0;
+    long busy = 0;            // turned away with ERROR BUSY
+    vector<double> latencies; // ms, finished sessions only
+};
+
+static int load_epoll = -1;
+static struct sockaddr_storage load_addr;
+static socklen_t load_addrlen = 0;
+static int load_assignments = 1;
+static protocol_choice load_protocol = PROTOCOL_AUTO;
+static long load_bytes_sent = 0;
+static long load_bytes_received = 0;
+static bool load_udp = false;
+static int load_stall_ms = 0;
+static int load_rcvbuf = 0;
+
+static bool loadSend(load_session *ls, const string &data) {
+    ssize_t sent = send(ls->fd, data.c_str(), data.length(), MSG_NOSIGNAL);
+    if (sent > 0) {
+        load_bytes_sent += sent;
+    }
+    return sent == (ssize_t)data.length();
+}
+
+// Start a session, on a new connection or on connected_socket if there is one.
+static void startLoadSession(load_session *ls, int connected_socket = -1) {
+    ls->state = LOAD_CONNECTING;
+    ls->first_line = true;
+    ls->offers_pipelining = false;
+    ls->offers_binary = false;
+    ls->pipelined = false;
+    ls->binary = false;
+    ls->count = 1;
+    ls->lines = 0;
+    ls->outcome = OUTCOME_OK;
+    lineReaderInit(&ls->reader);
+    ls->answers.clear();
+    ls->started = monotonicMs();
+    ls->last_progress = ls->started;
+    ls->stalled_until = 0;
+    
+    if (connected_socket >= 0) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = ls;
+        ls->fd = connected_socket;
+        if (load_rcvbuf > 0) {
+            setsockopt(ls->fd, SOL_SOCKET, SO_RCVBUF, &load_rcvbuf, sizeof(load_rcvbuf));
+        }
+        ls->state = LOAD_GREETING;
+        epoll_ctl(load_epoll, EPOLL_CTL_ADD, ls->fd, &ev);
+        return;
+    }
+    
+    ls->fd = socket(load_addr.ss_family, (load_udp ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK, 0);
+    if (ls->fd < 0) {
+        return; // Counted as failed by the timeout check
+    }
+    
+    if (load_udp) {
+        // Nothing to wait for, ask for the assignment right away
+        if (connect(ls->fd, (struct sockaddr *)&load_addr, load_addrlen) != 0 || !loadSend(ls, udpRequest())) {
+            close(ls->fd);
+            ls->fd = -1;
+            return;
+        }
+        
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = ls;
+        epoll_ctl(load_epoll, EPOLL_CTL_ADD, ls->fd, &ev);
+        ls->state = LOAD_ASSIGNMENT;
+        return;
+    }
+    
+    if (load_rcvbuf > 0) {
+        setsockopt(ls->fd, SOL_SOCKET, SO_RCVBUF, &load_rcvbuf, sizeof(load_rcvbuf));
+    }
+    
+    struct epoll_event ev;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = ls;
+    
+    if (connect(ls->fd, (struct sockaddr *)&load_addr, load_addrlen) == 0) {
+        ls->state = LOAD_GREETING;
+        ev.events = EPOLLIN;
+    } else if (errno != EINPROGRESS) {
+        close(ls->fd);
+        ls->fd = -1;
+        return;
+    }
+    
+    epoll_ctl(load_epoll, EPOLL_CTL_ADD, ls->fd, &ev);
+}
+
+static void finishLoadSession(load_session *ls, load_outcome outcome, load_stats &stats) {
+    if (ls->fd >= 0) {
+        close(ls->fd);
+        ls->fd = -1;
+    }
+    
+    if (outcome == OUTCOME_OK) {
+        stats.ok++;
+    } else if (outcome == OUTCOME_ERROR) {
+        stats.error++;
+    } else if (outcome == OUTCOME_TIMEOUT) {
+        stats.timeout++;
+    } else if (outcome == OUTCOME_BUSY) {
+        stats.busy++;
+    } else {
+        stats.failed++;
+    }
+    
+    if (outcome != OUTCOME_FAILED && outcome != OUTCOME_BUSY) {
+        stats.latencies.push_back(monotonicMs() - ls->started);
+    }
+}
+
+// Handle one complete line. Returns false when the session is over (outcome is set).
+static bool loadLine(load_session *ls, string_view line) {
+    if (ls->state == LOAD_GREETING) {
+        if (ls->first_line) {
+            ls->first_line = false;
+            if (line != "TEXT TCP 1.0") {
+                ls->outcome = line == "ERROR BUSY" ? OUTCOME_BUSY : OUTCOME_FAILED;
+                return false;
+            }
+            return true;
+        }
+        
+        if (line == "TEXT TCP 1.1") {
+            ls->offers_pipelining = true;
+        } else if (line == "BINARY TCP 1.0") {
+            ls->offers_binary = true;
+        }
+        
+        if (!line.empty()) {
+            return true;
+        }
+        
+        if (load_protocol == PROTOCOL_BINARY && !ls->offers_binary) {
+            ls->outcome = OUTCOME_FAILED;
+            return false;
+        }
+        
+        string reply = "OK\n";
+        if (ls->offers_binary && load_protocol != PROTOCOL_TEXT) {
+            ls->binary = true;
+            ls->pipelined = load_assignments > 1;
+            ls->count = min(load_assignments, MAX_PIPELINE);
+            reply = ls->pipelined ? "BINARY TCP 1.0 " + to_string(ls->count) + "\n" : "BINARY TCP 1.0\n";
+        } else if (load_assignments > 1 && ls->offers_pipelining) {
+            ls->pipelined = true;
+            ls->count = min(load_assignments, MAX_PIPELINE);
+            reply = "TEXT TCP 1.1 " + to_string(ls->count) + "\n";
+        }
+        
+        if (!loadSend(ls, reply)) {
+            ls->outcome = OUTCOME_FAILED;
+            return false;
+        }
+        ls->state = LOAD_ASSIGNMENT;
+        
+        if (load_stall_ms > 0) {
+            // Out of the epoll set until loadResume(), whatever arrives meanwhile waits in the socket
+            epoll_ctl(load_epoll, EPOLL_CTL_DEL, ls->fd, NULL);
+            ls->stalled_until = monotonicMs() + load_stall_ms;
+        }
+        return true;
+    }
+    
+    if (ls->state == LOAD_ASSIGNMENT) {
+        if (line == "ERROR TO") {
+            ls->outcome = OUTCOME_TIMEOUT;
+            return false;
+        }
+        
+        string result_string;
+        if (!solveAssignment(line, result_string, false)) {
+            ls->outcome = OUTCOME_FAILED;
+            return false;
+        }
+        
+        ls->answers += result_string;
+        ls->lines++;
+        
+        if (ls->lines == ls->count) {
+            if (!loadSend(ls, ls->answers)) {
+                ls->outcome = OUTCOME_FAILED;
+                return false;
+            }
+            ls->state = LOAD_VERDICT;
+            ls->lines = 0;
+        }
+        return true;
+    }
+    
+    // LOAD_VERDICT
+    if (line == "ERROR TO") {
+        ls->outcome = OUTCOME_TIMEOUT;
+        return false;
+    }
+    if (line != "OK" && ls->outcome == OUTCOME_OK) {
+        ls->outcome = OUTCOME_ERROR;
+    }
+    
+    ls->lines++;
+    return ls->lines < ls->count;
+}
+
+// Handle one BINARY TCP record. Returns false when the session is over (outcome is set).
+static bool loadRecord(load_session *ls, string_view block) {
+    binary_record record;
+    
+    if (!binaryDecode((const unsigned char *)block.data(), block.size(), &record)) {
+        ls->outcome = OUTCOME_FAILED;
+        return false;
+    }
+    if (record.type == BINARY_TIMEOUT) {
+        ls->outcome = OUTCOME_TIMEOUT;
+        return false;
+    }
+    
+    if (ls->state == LOAD_ASSIGNMENT) {
+        if (record.type != BINARY_ASSIGNMENT) {
+            ls->outcome = OUTCOME_FAILED;
+            return false;
+        }
+        
+        unsigned char answer[BINARY_MAX_RECORD];
+        record.type = BINARY_ANSWER;
+        record.result = calcEval(record.op, record.value1, record.value2);
+        ls->answers.append((const char *)answer, binaryEncode(answer, &record));
+        ls->lines++;
+        
+        if (ls->lines == ls->count) {
+            if (!loadSend(ls, ls->answers)) {
+                ls->outcome = OUTCOME_FAILED;
+                return false;
+            }
+            ls->state = LOAD_VERDICT;
+            ls->lines = 0;
+        }
+        return true;
+    }
+    
+    // LOAD_VERDICT
+    if (record.type != BINARY_OK && ls->outcome == OUTCOME_OK) {
+        ls->outcome = OUTCOME_ERROR;
+    }
+    
+    ls->lines++;
+    return ls->lines < ls->count;
+}
+
+// A TEXT UDP 1.0 datagram arrived. Returns false when the session is over (outcome is set).
+static bool loadDatagram(load_session *ls) {
+    char datagram[UDP_DATAGRAM_MAX];
+    ssize_t len = recv(ls->fd, datagram, sizeof(datagram), 0);
+    
+    if (len < 0 && errno == EAGAIN) {
+        return true;
+    }
+    if (len <= 0) {
+        ls->outcome = OUTCOME_FAILED;
+        return false;
+    }
+    
+    ls->last_progress = monotonicMs();
+    load_bytes_received += len;
+    string_view reply(datagram, len);
+    
+    if (ls->state == LOAD_ASSIGNMENT) {
+        string_view assignment_line;
+        string_view cookie;
+        string result_string;
+        
+        if (!splitUdpReply(reply, assignment_line, cookie) || !solveAssignment(assignment_line, result_string, false) ||
+            !loadSend(ls, string(cookie) + "\n" + result_string)) {
+            ls->outcome = OUTCOME_FAILED;
+            return false;
+        }
+        ls->state = LOAD_VERDICT;
+        return true;
+    }
+    
+    // LOAD_VERDICT
+    if (reply == "ERROR TO\n") {
+        ls->outcome = OUTCOME_TIMEOUT;
+    } else if (reply != "OK\n") {
+        ls->outcome = OUTCOME_ERROR;
+    }
+    return false;
+}
+
+// Handle the complete frames in the session's buffer. Returns false when the session is over
+// (outcome is set).
+static bool loadFrames(load_session *ls) {
+    string_view frame;
+    
+    while (ls->stalled_until == 0) {
+        if (ls->binary && ls->state != LOAD_GREETING) {
+            if (!binaryNextRecord(&ls->reader, &frame)) {
+                return true;
+            }
+            if (!loadRecord(ls, frame)) {
+                return false;
+            }
         } else {
-            result = 0.0;
+            if (!lineReaderNext(&ls->reader, &frame)) {
+                return true;
+            }
+            if (!loadLine(ls, frame)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Socket is ready. Returns false when the session is over (outcome is set).
+static bool loadReady(load_session *ls) {
+    if (load_udp) {
+        return loadDatagram(ls);
+    }
+    
+    if (ls->state == LOAD_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(ls->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            ls->outcome = OUTCOME_FAILED;
+            return false;
         }
         
-        // Format the float result
-        char buffer[100];
-        sprintf(buffer, "%8.8g", result);
-        result_string = string(buffer) + "\n";
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = ls;
+        epoll_ctl(load_epoll, EPOLL_CTL_MOD, ls->fd, &ev);
+        ls->state = LOAD_GREETING;
+        return true;
+    }
+    
+    ssize_t bytes_read = lineReaderFill(&ls->reader, ls->fd);
+    
+    if (bytes_read < 0 && errno == EAGAIN) {
+        return true;
+    }
+    if (bytes_read <= 0) {
+        ls->outcome = OUTCOME_FAILED; // Closed before we got all verdicts
+        return false;
+    }
+    
+    ls->last_progress = monotonicMs();
+    load_bytes_received += bytes_read;
+    
+    return loadFrames(ls);
+}
+
+// --stall is over for the session: take up the frames that are already buffered, and the socket
+// again. Returns false when the session is over (outcome is set).
+static bool loadResume(load_session *ls) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = ls;
+    epoll_ctl(load_epoll, EPOLL_CTL_ADD, ls->fd, &ev);
+    ls->stalled_until = 0;
+    ls->last_progress = monotonicMs();
+    
+    return loadFrames(ls);
+}
+
+static double percentile(const vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t index = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+// Run sessions over `connections` parallel connections until `duration` seconds have passed
+// (duration > 0) or `sessions` sessions have finished.
+static int runLoad(const string &hostname, const string &port_string, int connections, double duration, long sessions) {
+    int socktype = load_udp ? SOCK_DGRAM : SOCK_STREAM;
+    vector<server_address> *addresses = resolveServer(hostname, port_string, socktype);
+    
+    if (addresses == NULL) {
+        return 1;
+    }
+    
+    load_epoll = epoll_create1(0);
+    if (load_epoll < 0) {
+        cout << "epoll_create1 failed" << endl;
+        return 1;
+    }
+    
+    // Race the addresses once, every session then connects to the one that won. Its connection
+    // carries the first session.
+    int first_socket = -1;
+    if (!load_udp) {
+        first_socket = raceConnect(*addresses, socktype);
+        if (first_socket < 0) {
+            cout << "ERROR: CANT CONNECT TO " << hostname << endl;
+            return 1;
+        }
+    }
+    memcpy(&load_addr, &(*addresses)[0].addr, (*addresses)[0].addrlen);
+    load_addrlen = (*addresses)[0].addrlen;
+    
+    if (sessions > 0 && sessions < connections) {
+        connections = (int)sessions;
+    }
+    
+    vector<load_session> conns(connections);
+    load_stats stats;
+    long started = 0;
+    
+    for (int i = 0; i < connections; i++) {
+        startLoadSession(&conns[i], i == 0 ? first_socket : -1);
+        started++;
+    }
+    
+    double begin = monotonicMs();
+    double end = begin + duration * 1000.0;
+    double next_check = begin + 100;
+    long finished = 0;
+    struct epoll_event events[256];
+    
+    while (duration > 0 ? monotonicMs() < end : finished < sessions) {
+        // --stall ends to the millisecond
+        int n = epoll_wait(load_epoll, events, 256, load_stall_ms > 0 ? 1 : 100);
         
-    } else {
-        // Integer operation
-        long long value1 = atoll(value1_string.c_str());
-        long long value2 = atoll(value2_string.c_str());
-        long long result;
-        
-        if (operation == "add") {
-            result = value1 + value2;
-        } else if (operation == "sub") {
-            result = value1 - value2;
-        } else if (operation == "mul") {
-            result = value1 * value2;
+        for (int i = 0; i < n; i++) {
+            load_session *ls = (load_session *)events[i].data.ptr;
             
-        } else if (operation == "div") {
-            result = value1 / value2;
-        } else {
-            result = 0;
+            if (loadReady(ls)) {
+                continue;
+            }
+            
+            finishLoadSession(ls, ls->outcome, stats);
+            finished++;
+            
+            if (duration > 0 || started < sessions) {
+                startLoadSession(ls);
+                started++;
+            }
         }
         
-        // Convert to string
-        char buffer[100];
-        sprintf(buffer, "%lld", result);
-        result_string = string(buffer) + "\n";
+        double now = monotonicMs();
+        
+        for (int i = 0; i < connections && load_stall_ms > 0; i++) {
+            load_session *ls = &conns[i];
+            
+            if (ls->fd < 0 || ls->stalled_until == 0 || now < ls->stalled_until || loadResume(ls)) {
+                continue;
+            }
+            
+            finishLoadSession(ls, ls->outcome, stats);
+            finished++;
+            
+            if (duration > 0 || started < sessions) {
+                startLoadSession(ls);
+                started++;
+            }
+        }
+        
+        if (now < next_check) {
+            continue;
+        }
+        next_check = now + 100;
+        
+        // Sessions that could not start or got stuck
+        for (int i = 0; i < connections; i++) {
+            load_session *ls = &conns[i];
+            
+            if (ls->fd >= 0 && (now - ls->last_progress < LOAD_TIMEOUT_MS || ls->stalled_until > 0)) {
+                continue;
+            }
+            if (ls->fd < 0 && ls->state != LOAD_CONNECTING) {
+                continue; // Already finished and not restarted
+            }
+            
+            finishLoadSession(ls, ls->fd >= 0 ? OUTCOME_TIMEOUT : OUTCOME_FAILED, stats);
+            finished++;
+            
+            if (duration > 0 || started < sessions) {
+                startLoadSession(ls);
+                started++;
+            } else {
+                ls->state = LOAD_GREETING;
+            }
+        }
     }
     
-    // Send answer back to server
-    int send_result2 = send(client_socket, result_string.c_str(), result_string.length(), 0);
+    double elapsed = (monotonicMs() - begin) / 1000.0;
     
-    if (send_result2 <= 0) {
-        cout << "Failed to send result" << endl;
-        close(client_socket);
+    for (int i = 0; i < connections; i++) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd); // Still in flight, not counted
+        }
+    }
+    close(load_epoll);
+    
+    sort(stats.latencies.begin(), stats.latencies.end());
+    
+    long total = stats.ok + stats.error + stats.timeout + stats.failed + stats.busy;
+    
+    printf("sessions: %ld in %.2f s (%.1f sessions/s), %d connections, %d assignment(s) per session\n",
+           total, elapsed, total / elapsed, connections, load_assignments);
+    printf("OK: %ld ERROR: %ld TIMEOUT: %ld FAILED: %ld BUSY: %ld\n", stats.ok, stats.error, stats.timeout, stats.failed, stats.busy);
+    printf("latency ms: p50 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+           percentile(stats.latencies, 50), percentile(stats.latencies, 99),
+           percentile(stats.latencies, 99.9), stats.latencies.empty() ? 0.0 : stats.latencies.back());
+    
+    // What one session costs this side, to compare the protocols
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu_us = usage.ru_utime.tv_sec * 1e6 + usage.ru_utime.tv_usec + usage.ru_stime.tv_sec * 1e6 + usage.ru_stime.tv_usec;
+    long per = total > 0 ? total : 1;
+    printf("per session: %.1f bytes sent, %.1f bytes received, %.1f us client cpu\n",
+           (double)load_bytes_sent / per, (double)load_bytes_received / per, cpu_us / per);
+    
+    return stats.failed > 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int assignments = 1;
+    int connections = 0;
+    double duration = 0;
+    long sessions = 0;
+    int stall = 0;
+    int rcvbuf = 0;
+    protocol_choice protocol = PROTOCOL_AUTO;
+    bool udp = false;
+    bool usage = argc < 2;
+    
+    for (int i = 2; i < argc && !usage; i++) {
+        string option = argv[i];
+        
+        if (option == "--udp") {
+            udp = true;
+        } else if (i + 1 >= argc) {
+            usage = true;
+        } else if (option == "--assignments") {
+            assignments = atoi(argv[++i]);
+        } else if (option == "--connections") {
+            connections = atoi(argv[++i]);
+        } else if (option == "--duration") {
+            duration = atof(argv[++i]);
+        } else if (option == "--sessions") {
+            sessions = atol(argv[++i]);
+        } else if (option == "--stall") {
+            stall = atoi(argv[++i]);
+        } else if (option == "--rcvbuf") {
+            rcvbuf = atoi(argv[++i]);
+        } else if (option == "--protocol") {
+            string name = argv[++i];
+            if (name == "text") {
+                protocol = PROTOCOL_TEXT;
+            } else if (name == "binary") {
+                protocol = PROTOCOL_BINARY;
+            } else {
+                usage = true;
+            }
+        } else {
+            usage = true;
+        }
+    }
+    
+    bool load_mode = connections > 0 || duration > 0 || sessions > 0;
+    
+    if (usage || assignments < 1 || connections < 0 || duration < 0 || sessions < 0 || stall < 0 || rcvbuf < 0 || (duration > 0 && sessions > 0)) {
+        cout << "Usage: ./client <host:port> [--assignments N] [--protocol text|binary | --udp]" << endl;
+        cout << "       ./client <host:port> [--connections C] (--duration S | --sessions N) [--assignments N] [--protocol text|binary | --udp]" << endl;
+        cout << "       [--stall MS] [--rcvbuf BYTES]" << endl;
         return 1;
     }
     
-    // Get server's response
-    string server_response = "";
+    // Split the input into host and port parts
+    string input = argv[1];
+    
+    string hostname;
+    string port_string;
     
-    while (true) {
-        int bytes_read = recv(client_socket, &c, 1, 0);
+    // Check if this is IPv6 format with brackets like [::1]:5000
+    if (input[0] == '[') {
+        size_t bracket_end = input.find(']');
+        if (bracket_end == string::npos || bracket_end + 1 >= input.length() || input[bracket_end + 1] != ':') {
+            cout << "Invalid bracketed IPv6 format" << endl;
+            return 1;
+        }
+        hostname = input.substr(1, bracket_end - 1);
+        port_string = input.substr(bracket_end + 2);
+    } else {
+        // Find the last colon for host:port splitting
+        size_t colon_pos = input.rfind(':');
+        if (colon_pos == string::npos) {
+            cout << "Invalid host:port format" << endl;
+            return 1;
+        }
         
-        if (bytes_read <= 0) {
-            cout << "Failed to read server response" << endl;
-            close(client_socket);
+        hostname = input.substr(0, colon_pos);
+        port_string = input.substr(colon_pos + 1);
+    }
+    
+    cout << "Host " << hostname << ", and port " << port_string << "." << endl;
+    
+    if (load_mode) {
+        if (connections == 0) {
+            connections = 16;
+        }
+        if (duration == 0 && sessions == 0) {
+            duration = 10;
+        }
+        load_assignments = assignments;
+        load_protocol = protocol;
+        load_udp = udp;
+        load_stall_ms = udp ? 0 : stall;
+        load_rcvbuf = udp ? 0 : rcvbuf;
+        if (udp) {
+            load_assignments = 1; // One exchange per session
+        }
+        return runLoad(hostname, port_string, connections, duration, sessions);
+    }
+    
+    int done = 0;
+    int failed = 0;
+    
+    if (udp) {
+        int client_socket = connectToServer(hostname, port_string, SOCK_DGRAM);
+        
+        if (client_socket < 0) {
             return 1;
         }
         
-        if (c == '\n') {
-            break;
+        // No connection to set up, every assignment is its own exchange
+        for (done = 0; done < assignments; done++) {
+            if (runUdpExchange(client_socket) != 0) {
+                failed = 1;
+            }
         }
         
-        server_response = server_response + c;
+        close(client_socket);
+        return failed;
     }
     
-    // Clean up result for display
-    string display_result = result_string;
-    if (!display_result.empty() && display_result.back() == '\n') {
-        display_result.pop_back();
+    while (done < assignments) {
+        int client_socket = connectToServer(hostname, port_string);
+        
+        if (client_socket < 0) {
+            return 1;
+        }
+        
+        bool offers_pipelining;
+        bool offers_binary;
+        
+        line_reader reader;
+        lineReaderInit(&reader);
+        
+        if (!readGreeting(&reader, client_socket, offers_pipelining, offers_binary)) {
+            close(client_socket);
+            return 1;
+        }
+        
+        if (protocol == PROTOCOL_BINARY && !offers_binary) {
+            cout << "ERROR: SERVER DOES NOT OFFER BINARY TCP 1.0" << endl;
+            close(client_socket);
+            return 1;
+        }
+        
+        int rv;
+        
+        if (offers_binary && protocol != PROTOCOL_TEXT) {
+            // Records instead of text, all assignments on one connection
+            int count = min(assignments - done, MAX_PIPELINE);
+            rv = runBinarySession(&reader, client_socket, count);
+            done += count;
+        } else if (assignments > 1 && offers_pipelining) {
+            // One connection carries them all, up to what the server allows
+            int count = assignments - done;
+            if (count > MAX_PIPELINE) {
+                count = MAX_PIPELINE;
+            }
+            rv = runPipelinedSession(&reader, client_socket, count);
+            done += count;
+        } else {
+            // Server only speaks 1.0, one connection per assignment
+            rv = runSession(&reader, client_socket);
+            done++;
+        }
+        
+        close(client_socket);
+        
+        if (rv != 0) {
+            if (assignments == 1) {
+                return 1;
+            }
+            failed = 1;
+        }
     }
     
-    cout << server_response << " (myresult=" << display_result << ")" << endl;
-    
-    close(client_socket);
-    return 0;
-}
\ No newline at end of file
+    return failed;
+}
@@ -0,0 +1,117 @@
+#ifndef __LINE_READER
+#define __LINE_READER
+
+#include <string_view>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+
+  Buffered line reader for a socket.
+
+  One recv() pulls in as much as fits in a fixed buffer, then complete lines are handed out of
+  the buffer one by one as string_views (without the '\n'), so a whole exchange usually costs one
+  syscall per message instead of one per byte, and nothing is allocated. Partial lines stay in
+  the buffer until the rest arrives. Works the same on blocking and non-blocking sockets.
+
+  A line handed out by lineReaderNext() (or a block by lineReaderNextBlock()) stays valid until the
+  next lineReaderFill() or lineReaderAppend().
+
+  The buffer size is also the longest line (newline included) that can be framed, so the server
+  uses a small one per session to bound both memory and line length, see line_buffer<N>.
+
+*/
+
+#define LINE_READER_SIZE 4096
+
+template <size_t N> struct line_buffer {
+  char buf[N];
+  size_t start; // first byte not handed out yet
+  size_t end;   // end of the received data
+};
+
+typedef line_buffer<LINE_READER_SIZE> line_reader;
+
+template <size_t N> static inline void lineReaderInit(line_buffer<N> *r) {
+  r->start = 0;
+  r->end = 0;
+}
+
+/* Next complete line, if there is one in the buffer. */
+template <size_t N> static inline bool lineReaderNext(line_buffer<N> *r, std::string_view *line) {
+  char *first = r->buf + r->start;
+  char *newline = (char *)memchr(first, '\n', r->end - r->start);
+
+  if (newline == NULL) {
+    return false;
+  }
+
+  *line = std::string_view(first, newline - first);
+  r->start = newline + 1 - r->buf;
+  return true;
+}
+
+/* Next n bytes as one block, for protocols that switch to fixed-size records (n <= N). */
+template <size_t N> static inline bool lineReaderNextBlock(line_buffer<N> *r, size_t n, std::string_view *block) {
+  if (r->end - r->start < n) {
+    return false;
+  }
+
+  *block = std::string_view(r->buf + r->start, n);
+  r->start += n;
+  return true;
+}
+
+/* True when the buffer holds N bytes without a newline, the line is too long to ever complete. */
+template <size_t N> static inline bool lineReaderFull(const line_buffer<N> *r) {
+  return r->start == 0 && r->end == sizeof(r->buf);
+}
+
+template <size_t N> static inline void lineReaderCompact(line_buffer<N> *r) {
+  if (r->start > 0) {
+    // Move the partial line to the front to make room behind it
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+}
+
+/* One recv() into the free space. Returns what recv() returned (0 when the peer closed, -1 with
+   errno set, EAGAIN on a drained non-blocking socket). Call only when lineReaderNext()
+   (or lineReaderNextBlock()) is false. */
+template <size_t N> static inline ssize_t lineReaderFill(line_buffer<N> *r, int fd) {
+  lineReaderCompact(r);
+
+  if (r->end == sizeof(r->buf)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  ssize_t n;
+  do {
+    n = recv(fd, r->buf + r->end, sizeof(r->buf) - r->end, 0);
+  } while (n < 0 && errno == EINTR);
+
+  if (n > 0) {
+    r->end += n;
+  }
+  return n;
+}
+
+/* As lineReaderFill(), for bytes that were received elsewhere (an io_uring buffer). Copies what
+   fits of the len bytes at data and returns how many that was. */
+template <size_t N> static inline size_t lineReaderAppend(line_buffer<N> *r, const char *data, size_t len) {
+  lineReaderCompact(r);
+
+  size_t n = sizeof(r->buf) - r->end;
+  if (n > len) {
+    n = len;
+  }
+  memcpy(r->buf + r->end, data, n);
+  r->end += n;
+  return n;
+}
+
+#endif
@@ -5,6 +5,8 @@
 
 /* Include the calcLib header file, using <> as its a library and not just a object file we link.  */
 #include <calcLib.h>
+/* The operator table: the code, name, type and reference calculation of every operator. */
+#include "calcOps.h"
 
 
 
@@ -26,8 +28,9 @@ int main(int argc, char *argv[]){
 
   /* Initialize the library, this is needed for this library. */
   initCalcLib();
-  char *ptr;
-  ptr=randomType(); // Get a random arithemtic operator. 
+  int op;
+  op=randomOp(); // Get a random arithemtic operator, as its code. 
+  const char *ptr=calc_ops[op].name; // ... and its name. 
 
   double f1,f2,fresult;
   int i1,i2,iresult;
@@ -46,31 +49,15 @@ int main(int argc, char *argv[]){
   printf("Float Values: %8.8g %8.8g \n",f1,f2);
 
   
-  /* Act differently depending on what operator you got, judge type by first char in string. If 'f' then a float */
+  /* Act differently depending on what operator you got, the table tells if it takes floats. The table also 
+     holds the reference calculation, so there is no need to compare strings to find it. */
   
-  if(ptr[0]=='f'){
-    /* At this point, ptr holds operator, f1 and f2 the operands. Now we work to determine the reference result. */
-   
-    if(strcmp(ptr,"fadd")==0){
-      fresult=f1+f2;
-    } else if (strcmp(ptr, "fsub")==0){
-      fresult=f1-f2;
-    } else if (strcmp(ptr, "fmul")==0){
-      fresult=f1*f2;
-    } else if (strcmp(ptr, "fdiv")==0){
-      fresult=f1/f2;
-    }
+  if(calc_ops[op].is_float){
+    /* At this point, op holds operator, f1 and f2 the operands. Now we work to determine the reference result. */
+    fresult=calc_ops[op].eval(f1,f2);
     printf("%s %8.8g %8.8g = %8.8g\n",ptr,f1,f2,fresult);
   } else {
-    if(strcmp(ptr,"add")==0){
-      iresult=i1+i2;
-    } else if (strcmp(ptr, "sub")==0){
-      iresult=i1-i2;
-    } else if (strcmp(ptr, "mul")==0){
-      iresult=i1*i2;
-    } else if (strcmp(ptr, "div")==0){
-      iresult=i1/i2;
-    }
+    iresult=(int)calc_ops[op].eval(i1,i2); // div by 0 gives 0 
 
     printf("%s %d %d = %d \n",ptr,i1,i2,iresult);
   }
@@ -103,7 +90,11 @@ int main(int argc, char *argv[]){
   
   printf("Command: |%s|\n",command);
   
-  if(command[0]=='f'){
+  /* Turn the name into an operator code. calcOpLookup() gives -1 for anything that is not an operator. */
+  op=calcOpLookup(command);
+  if(op<0){
+    printf("No match\n");
+  } else if(calc_ops[op].is_float){
     printf("Float\t");
     rv=sscanf(lineBuffer,"%s %lg %lg",command,&f1,&f2);
     if (rv == EOF ) {
@@ -111,15 +102,7 @@ int main(int argc, char *argv[]){
       free(lineBuffer); // This is needed for the getline() as it will allocate memory (if the provided buffer is NUL).
       exit(1);
     }
-    if(strcmp(command,"fadd")==0){
-      fresult=f1+f2;
-    } else if (strcmp(command, "fsub")==0){
-      fresult=f1-f2;
-    } else if (strcmp(command, "fmul")==0){
-      fresult=f1*f2;
-    } else if (strcmp(command, "fdiv")==0){
-      fresult=f1/f2;
-    }
+    fresult=calc_ops[op].eval(f1,f2);
     printf("%s %8.8g %8.8g = %8.8g\n",command,f1,f2,fresult);
   } else {
     printf("Int\t");
@@ -129,18 +112,7 @@ int main(int argc, char *argv[]){
       free(lineBuffer); // This is needed for the getline() as it will allocate memory (if the provided buffer is NUL).
       exit(1);
     }
-    if(strcmp(command,"add")==0){
-      iresult=i1+i2;
-    } else if (strcmp(command, "sub")==0){
-      iresult=i1-i2;
-      printf("[%s %d %d = %d ]\n",command,i1,i2,iresult);
-    } else if (strcmp(command, "mul")==0){
-      iresult=i1*i2;
-    } else if (strcmp(command, "div")==0){     
-      iresult=i1/i2;
-    } else {
-      printf("No match\n");
-    }
+    iresult=(int)calc_ops[op].eval(i1,i2); // div by 0 gives 0 
 
     printf("%s %d %d = %d \n",command,i1,i2,iresult);
   }
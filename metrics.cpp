@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+
+static const char *phase_names[METRICS_PHASES] = {
+  "calc_accept_to_greeting_seconds",
+  "calc_greeting_to_choice_seconds",
+  "calc_assignment_to_answer_seconds",
+  "calc_session_seconds",
+};
+
+static const char *phase_help[METRICS_PHASES] = {
+  "Time from accept() to the greeting being sent.",
+  "Time from the greeting to the client's protocol choice.",
+  "Time from the assignments being sent to each answer.",
+  "Time from accept() to the session being closed.",
+};
+
+static unsigned long sum(const std::atomic<unsigned long> *first, const struct worker_metrics *all, int n) {
+  // first points into all[0], the same field of the other workers is sizeof(worker_metrics) apart
+  size_t offset = (const char *)first - (const char *)&all[0];
+  unsigned long total = 0;
+
+  for (int i = 0; i < n; i++) {
+    const std::atomic<unsigned long> *field = (const std::atomic<unsigned long> *)((const char *)&all[i] + offset);
+    total += field->load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+static void append(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append(std::string &out, const char *format, ...) {
+  char line[256];
+  va_list args;
+
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  out.append(line, len < (int)sizeof(line) ? len : sizeof(line) - 1);
+}
+
+static void renderPerOp(std::string &out, const char *name, const char *help,
+                        const std::atomic<unsigned long> *counters, const struct worker_metrics *all, int n) {
+  append(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+  for (int op = 0; op < METRICS_OPS; op++) {
+    append(out, "%s{op=\"%s\"} %lu\n", name, calc_ops[op].name, sum(&counters[op], all, n));
+  }
+}
+
+void metricsRender(std::string &out, const struct worker_metrics *all, int n) {
+  append(out, "# HELP calc_accepts_total Connections accepted.\n# TYPE calc_accepts_total counter\n");
+  append(out, "calc_accepts_total %lu\n", sum(&all[0].accepts, all, n));
+  append(out, "# HELP calc_handshake_timeouts_total Sessions closed before the client chose a protocol.\n");
+  append(out, "# TYPE calc_handshake_timeouts_total counter\n");
+  append(out, "calc_handshake_timeouts_total %lu\n", sum(&all[0].handshake_timeouts, all, n));
+  append(out, "# HELP calc_shed_total Connections turned away with ERROR BUSY because too many sessions were open.\n");
+  append(out, "# TYPE calc_shed_total counter\n");
+  append(out, "calc_shed_total %lu\n", sum(&all[0].shed, all, n));
+  append(out, "# HELP calc_trace_dropped_total Trace records lost because the disk fell behind (--record).\n");
+  append(out, "# TYPE calc_trace_dropped_total counter\n");
+  append(out, "calc_trace_dropped_total %lu\n", sum(&all[0].trace_dropped, all, n));
+
+  renderPerOp(out, "calc_assignments_total", "Assignments handed out.", all[0].assignments, all, n);
+
+  append(out, "# HELP calc_answers_total Answers checked, by verdict.\n# TYPE calc_answers_total counter\n");
+  for (int op = 0; op < METRICS_OPS; op++) {
+    append(out, "calc_answers_total{op=\"%s\",verdict=\"ok\"} %lu\n", calc_ops[op].name, sum(&all[0].ok[op], all, n));
+    append(out, "calc_answers_total{op=\"%s\",verdict=\"error\"} %lu\n", calc_ops[op].name, sum(&all[0].error[op], all, n));
+  }
+
+  renderPerOp(out, "calc_timeouts_total", "Answers that did not arrive in time (ERROR TO).", all[0].timeouts, all, n);
+
+  for (int p = 0; p < METRICS_PHASES; p++) {
+    const struct metrics_histogram *h = &all[0].phases[p];
+    const char *name = phase_names[p];
+    unsigned long cumulative = 0;
+
+    append(out, "# HELP %s %s\n# TYPE %s histogram\n", name, phase_help[p], name);
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+      cumulative += sum(&h->buckets[b], all, n);
+      append(out, "%s_bucket{le=\"%.12g\"} %lu\n", name, (1024.0 * (1UL << b)) / 1e9, cumulative);
+    }
+    cumulative += sum(&h->buckets[METRICS_BUCKETS - 1], all, n);
+    append(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, cumulative);
+    append(out, "%s_sum %.9f\n", name, sum(&h->sum_ns, all, n) / 1e9);
+    append(out, "%s_count %lu\n", name, cumulative);
+  }
+}
+
+void metricsServe(int listenfd, const struct worker_metrics *all, int n) {
+  std::string response;
+
+  while (1) {
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd == -1) {
+      continue;
+    }
+
+    // Don't let a silent scraper hold up the next one
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Whatever was asked, everyone gets the metrics; the request only has to arrive
+    char request[1024];
+    recv(fd, request, sizeof(request), 0);
+
+    std::string body;
+    metricsRender(body, all, n);
+
+    response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ";
+    response += std::to_string(body.size());
+    response += "\r\nConnection: close\r\n\r\n";
+    response += body;
+
+    size_t sent = 0;
+    while (sent < response.size()) {
+      ssize_t r = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+      if (r <= 0) {
+        break;
+      }
+      sent += r;
+    }
+    close(fd);
+  }
+}
@@ -0,0 +1,83 @@
+#ifndef __METRICS
+#define __METRICS
+
+#include <atomic>
+#include <string>
+
+#include "calcOps.h"
+
+/*
+
+  Server metrics: counters and latency histograms, exported in the Prometheus text format.
+
+  Every worker owns one worker_metrics and is the only thread that writes it, so recording is a
+  relaxed load and store of a counter the worker already has in its cache (no lock prefix, no
+  sharing). The atomics are only there so the stats thread can read while the workers write;
+  it sums all workers when it renders, so a scrape may see one worker a few samples ahead of
+  another but never a torn value.
+
+  Histograms have power-of-two buckets: bucket i counts samples below 1024 << i nanoseconds
+  (about 1 us, 2 us, 4 us, ... 8.6 s), the last one everything above. Picking the bucket is one
+  count-leading-zeros.
+
+  Rendering and the stats endpoint are in metrics.cpp
+
+*/
+
+#define METRICS_OPS CALC_OP_COUNT // One per operator, indexed by enum calc_op
+#define METRICS_BUCKETS 24
+
+enum metrics_phase {
+  PHASE_ACCEPT_TO_GREETING,   // accept() returned until the greeting is out
+  PHASE_GREETING_TO_CHOICE,   // greeting out until the client's "OK" or protocol line
+  PHASE_ASSIGNMENT_TO_ANSWER, // assignment(s) out until each answer arrives
+  PHASE_SESSION,              // accept() returned until the session is closed
+  METRICS_PHASES
+};
+
+struct metrics_histogram {
+  std::atomic<unsigned long> buckets[METRICS_BUCKETS];
+  std::atomic<unsigned long> sum_ns;
+};
+
+struct alignas(64) worker_metrics {
+  std::atomic<unsigned long> accepts;
+  std::atomic<unsigned long> handshake_timeouts;         // no protocol choice in time
+  std::atomic<unsigned long> shed;                       // turned away with ERROR BUSY (--max-sessions)
+  std::atomic<unsigned long> trace_dropped;              // --record: records lost, the disk fell behind
+  std::atomic<unsigned long> assignments[METRICS_OPS];
+  std::atomic<unsigned long> ok[METRICS_OPS];
+  std::atomic<unsigned long> error[METRICS_OPS];
+  std::atomic<unsigned long> timeouts[METRICS_OPS];      // answer not in time, or after the UDP deadline
+  struct metrics_histogram phases[METRICS_PHASES];
+};
+
+/* Counts one event. Only the owning worker may call this. */
+static inline void metricsCount(std::atomic<unsigned long> *counter) {
+  counter->store(counter->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+static inline int metricsBucket(long long ns) {
+  if (ns < 1024) {
+    return 0;
+  }
+  int bucket = 64 - __builtin_clzll((unsigned long long)ns >> 10);
+  return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+/* Records one latency sample. Only the owning worker may call this. */
+static inline void metricsRecord(struct worker_metrics *m, enum metrics_phase phase, long long ns) {
+  struct metrics_histogram *h = &m->phases[phase];
+
+  metricsCount(&h->buckets[metricsBucket(ns)]);
+  h->sum_ns.store(h->sum_ns.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+/* Appends the sum over n workers in the Prometheus text format to out. */
+void metricsRender(std::string &out, const struct worker_metrics *all, int n);
+
+/* Serves the metrics of n workers over HTTP on listenfd, one scrape at a time. Does not return,
+   run it on its own thread. */
+void metricsServe(int listenfd, const struct worker_metrics *all, int n);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef __NUM_CODEC
+#define __NUM_CODEC
+
+#include <charconv>
+#include <string.h>
+
+/*
+
+  Number formatting and parsing for the wire, built on std::to_chars/std::from_chars.
+
+  printf/atof go through the locale machinery on every call, these do not: no locale, no
+  allocation, no varargs. The output is byte for byte what the printf formats named below give
+  ("make bench" checks that against snprintf before it times anything), and the parsers accept
+  what atof/atoll accept for the numbers we exchange (leading blanks, a sign, trailing junk).
+
+*/
+
+#define NUM_MAX_CHARS 32 // Enough for any value written by these functions
+
+/* Same as sprintf(out, "%8.8g", v) without the terminating NUL. Returns the length. */
+static inline int formatG8(char *out, double v) {
+  char digits[NUM_MAX_CHARS];
+  std::to_chars_result r = std::to_chars(digits, digits + sizeof(digits), v, std::chars_format::general, 8);
+  int len = (int)(r.ptr - digits);
+  int pad = len < 8 ? 8 - len : 0;
+
+  memset(out, ' ', pad); // Right aligned in a field of 8, like the printf width
+  memcpy(out + pad, digits, len);
+  return pad + len;
+}
+
+/* Same as sprintf(out, "%d" or "%lld", v) without the terminating NUL. Returns the length. */
+static inline int formatInt(char *out, long long v) {
+  return (int)(std::to_chars(out, out + NUM_MAX_CHARS, v).ptr - out);
+}
+
+static inline const char *skipBlanks(const char *first, const char *last) {
+  while (first < last && (*first == ' ' || *first == '\t' || *first == '\r' || *first == '\n')) {
+    first++;
+  }
+  if (first < last && *first == '+' && first + 1 < last && *(first + 1) != '-') {
+    first++; // from_chars takes '-' but not '+'
+  }
+  return first;
+}
+
+/* Like atof on [first, last): 0.0 if there is no number. */
+static inline double parseDouble(const char *first, const char *last) {
+  double v = 0.0;
+  std::from_chars(skipBlanks(first, last), last, v);
+  return v;
+}
+
+/* Like atoll on [first, last): 0 if there is no number. */
+static inline long long parseInt(const char *first, const char *last) {
+  long long v = 0;
+  std::from_chars(skipBlanks(first, last), last, v);
+  return v;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#!/bin/sh
+#
+# Regression checks for the server's event loops, on loopback. Each case starts a server (on
+# epoll, then with --uring), puts a load on it with the client that used to break it, and fails
+# if the server died or a session ended other than the case allows. "make check" runs it.
+#
+# usage: ./regress.sh [server] [client] [port]
+#
+# Exits 0 if every case passed. ROUNDS (default 3) in the environment repeats each case; the bugs
+# they look for are races, a single clean round proves little.
+
+SERVER=${1:-./server}
+CLIENT=${2:-./client}
+PORT=${3:-5798}
+ROUNDS=${ROUNDS:-3}
+failures=0
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+# Start "$SERVER" with the given options on a fresh port, and wait for it to listen
+startServer() {
+  PORT=$((PORT + 1))
+  ADDRESS=127.0.0.1:$PORT
+  "$SERVER" "$ADDRESS" --seed 1 "$@" >/dev/null &
+  pid=$!
+
+  tries=0
+  until "$CLIENT" "$ADDRESS" >/dev/null 2>&1; do
+    tries=$((tries + 1))
+    if [ $tries -ge 50 ] || ! kill -0 $pid 2>/dev/null; then
+      echo "$SERVER did not come up on $ADDRESS"
+      kill $pid 2>/dev/null
+      exit 1
+    fi
+    sleep 0.1
+  done
+}
+
+# Stop the server; fails the case if it is no longer running
+stopServer() {
+  if ! kill -0 $pid 2>/dev/null; then
+    wait $pid
+    echo "  server died, exit status $?"
+    return 1
+  fi
+  kill -TERM $pid
+  wait $pid
+  return 0
+}
+
+# check NAME ALLOWED CLIENT-OPTIONS...: runs the client's load mode, and fails unless every
+# session ended with one of the ALLOWED outcomes (a list like "OK TIMEOUT")
+check() {
+  what=$1
+  allowed=$2
+  shift 2
+  out=$("$CLIENT" "$ADDRESS" "$@" 2>&1)
+  echo "$out" | awk -v name="$what" -v allowed="$allowed" '
+    /^OK:/ {
+      seen = 1
+      for (i = 1; i < NF; i += 2) {
+        outcome = $i
+        sub(/:$/, "", outcome)
+        if ($(i + 1) > 0 && index(" " allowed " ", " " outcome " ") == 0) {
+          bad = bad " " outcome "=" $(i + 1)
+        }
+      }
+    }
+    END {
+      if (!seen || bad != "") {
+        printf "  %s: unexpected outcomes%s\n", name, seen ? bad : " (no summary)"
+        exit 1
+      }
+    }'
+}
+
+# run NAME CASE ARGS...: runs one case, with what went wrong below its result line
+run() {
+  case_name=$1
+  shift
+  if "$@" >"$log" 2>&1; then
+    printf "%-40s ok\n" "$case_name"
+  else
+    printf "%-40s FAILED\n" "$case_name"
+    cat "$log"
+    failures=$((failures + 1))
+  fi
+}
+
+# Thousands of sessions answer right around their deadline, so sessions expire in the same
+# epoll_wait() batch that reports their answers. An answer that arrives just after ERROR TO is
+# unread when the server closes, so the kernel resets the connection and the client may lose
+# ERROR TO: FAILED is allowed, a wrong verdict or a dead server is not.
+answersAtDeadline() {
+  startServer "$@"
+  ok=0
+  check "answers at the deadline" "OK TIMEOUT FAILED" --connections 8000 --sessions 8000 --stall 5000 || ok=1
+  stopServer || ok=1
+  return $ok
+}
+
+# The server sends more than the sockets hold (the smallest SO_SNDBUF and SO_RCVBUF there are,
+# 256 assignments) to sessions that read nothing until after their deadline. The assignments and
+# ERROR TO are still queued when the session closes, and must all arrive once the client reads.
+slowReader() {
+  startServer --sndbuf 1 "$@"
+  ok=0
+  check "slow reader" "TIMEOUT" --connections 50 --sessions 50 --assignments 256 --protocol text \
+    --rcvbuf 1 --stall 6000 || ok=1
+  stopServer || ok=1
+  return $ok
+}
+
+for round in $(seq "$ROUNDS"); do
+  run "answers at the deadline, epoll" answersAtDeadline
+  run "answers at the deadline, io_uring" answersAtDeadline --uring
+  run "slow reader, epoll" slowReader
+  run "slow reader, io_uring" slowReader --uring
+done
+
+[ $failures -eq 0 ]
@@ -2,228 +2,1856 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <math.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <signal.h>
 
 #include <calcLib.h>
+#include "calcOps.h"
+#include "timerWheel.h"
+#include "assignmentRing.h"
+#include "numCodec.h"
+#include "lineReader.h"
+#include "binaryProtocol.h"
+#include "textProtocol.h"
+#include "sipHash.h"
+#include "metrics.h"
+#include "uring.h"
+#include "sessionTask.h"
+#include "trace.h"
+#include "slabPool.h"
 
 #define DEBUG
 
+#define MAX_EVENTS 256
+#define SESSION_TIMEOUT_MS 5000 // Same 5 seconds as the old select() calls
+#define TIMER_TICK_MS 10        // Resolution of the timeout wheel
+#define MAX_PIPELINE 256        // Most assignments a TEXT TCP 1.1 client may ask for
+#define EXPECTED_POOLS 8        // Pools for pipelined sessions, for counts up to 2, 4, ... MAX_PIPELINE
+#define PRODUCER_BATCH 256      // Assignments the ring producer draws per calcLib call
+#define MAX_WORKERS 256
+#define MAX_LINE 256            // Longest line a client may send, newline included
+#define UDP_BATCH 64            // Datagrams per recvmmsg()/sendmmsg()
+#define UDP_DATAGRAM_MAX 512    // Anything longer is not ours and gets cut off
+#define UDP_REPLY_MAX 128
+#define URING_ENTRIES 4096      // --uring: submission ring size per worker
+#define URING_BUFFERS 4096      // --uring: provided receive buffers per worker, shared by its sessions
+#define URING_BUFFER_SIZE 512
+#define DEFAULT_BACKLOG 1024    // --backlog, connections the kernel queues before we accept them
+#define LINGER_MS 5000          // Longest a closed session waits for the socket to take its last output
+
 using namespace std;
 
-void sendAssignment(int clientfd, double *server_result, int *is_float) {
-  char *op = randomType();
-  char msg[1450];
-  
-  memset(msg, 0, sizeof(msg));
-  
-  if (op[0] == 'f') {
-    double fv1 = randomFloat();
-    double fv2 = randomFloat();
-    double fresult;
-    
-    if (strcmp(op, "fadd") == 0) {
-      fresult = fv1 + fv2;
-    } else if (strcmp(op, "fsub") == 0) {
-      fresult = fv1 - fv2;
-    } else if (strcmp(op, "fmul") == 0) {
-      fresult = fv1 * fv2;
-    } else if (strcmp(op, "fdiv") == 0) {
-      fresult = fv1 / fv2;
-    }
-    
-    sprintf(msg, "%s %8.8g %8.8g\n", op, fv1, fv2);
-    *server_result = fresult;
-    *is_float = 1;
-    
-  } else {
-    int iv1 = randomInt();
-    int iv2 = randomInt();
-    int iresult;
-    
-    if (strcmp(op, "add") == 0) {
-      iresult = iv1 + iv2;
-    } else if (strcmp(op, "sub") == 0) {
-      iresult = iv1 - iv2;
-    } else if (strcmp(op, "mul") == 0) {
-      iresult = iv1 * iv2;
-    } else if (strcmp(op, "div") == 0) {
-      iresult = iv1 / iv2;
-    }
-    
-    sprintf(msg, "%s %d %d\n", op, iv1, iv2);
-    *server_result = (double)iresult;
-    *is_float = 0;
+/*
+   Protocols we offer, the client picks one in its reply:
+
+     "OK\n"               TEXT TCP 1.0, one assignment, one answer, one verdict.
+     "TEXT TCP 1.1 <N>\n"  N assignments (1..MAX_PIPELINE) are sent right away. The client
+                          may send all N answers without waiting, and gets one "OK\n" or
+                          "ERROR\n" per answer, in order. The 5 second timeout restarts
+                          whenever an answer arrives.
+     "BINARY TCP 1.0\n"     Like TEXT TCP 1.0, and "BINARY TCP 1.0 <N>\n" like TEXT TCP 1.1, but
+                          everything after this line is fixed-size binary records, see
+                          binaryProtocol.h.
+
+   GREETING, in textProtocol.h, lists them.
+*/
+
+/*
+   With --eager the server offers TEXT TCP 1.0 alone and sends its assignment along with the
+   greeting, without waiting for the "OK\n". The client finds the assignment in its socket as soon
+   as it has read the greeting and said OK, one round trip earlier. The "OK\n" is still expected
+   before the answer; anything else ends the session.
+*/
+#define EAGER_GREETING "TEXT TCP 1.0\n\n"
+
+/*
+   With --max-sessions, a connection that comes in while the worker already has its share of the
+   sessions open gets this instead of the greeting, and is closed right away. A client that is
+   turned away can retry elsewhere or later; one that waited in line would only see every session
+   ahead of it get slower.
+*/
+#define BUSY "ERROR BUSY\n"
+
+/*
+   With --udp there are no connections and no sessions. Every exchange is two datagrams each way:
+
+     client: "TEXT UDP 1.0\n", padded to UDP_REQUEST_MIN bytes
+     server: "<op> <v1> <v2>\n<cookie>\n"
+     client: "<cookie>\n<answer>\n"
+     server: "OK\n", "ERROR\n", or "ERROR TO\n" if the answer came in after the deadline
+
+   The cookie carries the reference result and the deadline, signed together with the client's
+   address, so the server keeps nothing between the two exchanges. Datagrams that do not parse or
+   carry a bad cookie get no reply. The padding means a reply is never bigger than the request that
+   asked for it, so the server cannot be used to amplify spoofed traffic.
+*/
+#define UDP_REQUEST "TEXT UDP 1.0\n"
+#define UDP_REQUEST_MIN 96
+#define COOKIE_SIZE 24          // result, deadline with op and float flag, MAC; sent as 48 hex digits
+#define COOKIE_OP_BITS 8        // the op's field in the cookie, below the deadline and above the float flag
+
+static_assert(CALC_OP_COUNT <= 1 << COOKIE_OP_BITS, "the cookie's op field must hold every operator");
+
+/*
+   Every client is a session, and every session is a coroutine, runSession(), that reads like the
+   exchange itself: send the greeting, wait for the protocol choice, send the assignments, wait for
+   the answers. Waiting suspends the coroutine and the event loop moves on, so thousands of sessions
+   can be at different places in the exchange at the same time. The loop resumes a session with
+   one of these events:
+*/
+enum session_event {
+  SESSION_FRAME,   // a complete line (or record) from the client is in s->frame
+  SESSION_TIMEOUT, // the deadline passed first
+  SESSION_CLOSED   // the client is gone, or sent a line longer than MAX_LINE
+};
+
+struct expected {
+  double server_result;
+  int is_float;
+  int op;
+  double answer;              // the client's result, kept until it is graded
+  double value1;              // --record: the operands, as the client got them
+  double value2;
+};
+
+/*
+   Sessions come from the worker's slab pool, so each starts on a cache line. What handling a frame
+   touches comes first, the receive buffer follows, and what is only used when a session opens,
+   times out or closes is at the end.
+*/
+struct alignas(64) session {
+  std::coroutine_handle<> task; // runSession(), suspended until the next event
+  std::string_view frame;     // the frame with SESSION_FRAME, valid until the next wait
+  int fd;
+  int event;                  // enum session_event it is resumed with
+  int binary;                 // BINARY TCP 1.0, records instead of lines after the handshake
+  int count;                  // assignments sent
+  int answered;               // answers received so far
+  int graded;                 // answers graded and given a verdict so far
+  struct expected *expected;  // one per assignment, points at single for TEXT TCP 1.0
+  struct out_block *out;      // output waiting for the next send, see sessionSend()
+  long long assigned_ns;      // phase start times for the latency histograms
+  struct timer_node timer;    // ERROR TO deadline of the current wait
+  int recv_armed;             // io_uring: the multishot recv still posts completions for us
+  struct out_block *in_flight; // io_uring: the send under way, the next one waits for it
+  int want_out;               // epoll: EPOLLOUT is in the session's events, see sessionFlush()
+  int lingering;              // closed, the socket has yet to take the last output; LINGER_MS timer
+  int closed;                 // io_uring: closed, freed once neither a recv nor a send refers to it
+  line_buffer<MAX_LINE> in;   // received bytes, framed into lines
+  struct expected single;
+  long long accepted_ns;
+  long long greeted_ns;
+  int pipelined;              // TEXT TCP 1.1, or BINARY TCP 1.0 with a count
+  int timed_out;              // ended with ERROR TO
+  unsigned int id;            // numbered per worker, for --record
+};
+
+/*
+   A session's output queue: what sessionSend() collects until the next flush, in one block. On
+   io_uring the block goes with the send that carries it and back to its pool when the send
+   completes, so the session can fill the next one meanwhile; that one is sent when the first is
+   done, as two sends under way on one socket may go out in either order. On epoll the block
+   stays with the session until the socket has taken all of it. Most transitions produce a few
+   lines and fit a small block; the assignments of a large pipelined request move to a large one.
+*/
+#define OUT_BLOCK_SMALL 512
+#define OUT_BLOCK_LARGE 16384
+
+struct out_block {
+  struct slab_pool *pool; // the pool it came from
+  struct session *session; // io_uring: whose send it is
+  int start;              // epoll: first byte the socket has not taken yet
+  int len;
+  int cap;                // bytes of data after the header
+};
+
+static inline char *outData(struct out_block *b) {
+  return (char *)(b + 1);
+}
+
+static_assert(2 << (EXPECTED_POOLS - 1) == MAX_PIPELINE, "the largest expected pool must hold MAX_PIPELINE");
+static_assert(MAX_PIPELINE * sizeof(((struct assignment *)0)->msg) <= OUT_BLOCK_LARGE - sizeof(struct out_block),
+              "a large output block must hold the assignments of the largest pipelined request");
+
+/*
+   A worker is one event loop with its own listening socket. With --workers N we run N of
+   them on separate threads, all bound to the same host:port with SO_REUSEPORT, so the kernel
+   spreads new connections over them. Workers share nothing.
+*/
+struct worker {
+  int id;
+  int udp;                   // --udp, listenfd is a datagram socket and there are no sessions
+  int listenfd;
+  int epollfd;
+  int timerfd;               // ticks the wheel while any timer is armed
+  int timer_running;
+  unsigned long long seed;   // replay a worker's assignments by starting it with the same seed
+  calc_rng_t rng;            // this worker's own calcLib generator
+  struct assignment_ring *ring; // prepared assignments (--ring), NULL to draw them on the spot
+  struct timer_wheel wheel;  // deadlines of all open sessions of this worker
+  struct worker_metrics *metrics; // written by this worker only, read by the --stats thread
+  int sessions;              // open sessions
+  unsigned int last_session; // id of the newest session
+  int max_sessions;          // this worker's share of --max-sessions, 0 for no limit
+  int eager;                 // --eager, the assignment goes out with the greeting
+  int sndbuf;                // --sndbuf, SO_SNDBUF of client sockets, 0 for the kernel default
+  int want_uring;            // --uring, try io_uring before falling back to epoll
+  struct uring *uring;       // NULL when the worker runs on epoll
+  struct trace_buffer *trace; // --record, NULL when not recording
+  struct trace_replay *replay; // --replay, shared by all workers; NULL to draw new assignments
+  struct slab_pool session_pool; // struct session
+  struct slab_pool expected_pools[EXPECTED_POOLS]; // struct expected of pipelined sessions, see expectedPool()
+  struct slab_pool out_small;  // struct out_block of OUT_BLOCK_SMALL bytes
+  struct slab_pool out_large;  // and of OUT_BLOCK_LARGE
+  pthread_t thread;
+};
+
+static long long nowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+   sessionSend() only queues the bytes in s->out. Everything one event produced (the greeting, a
+   batch of assignments, the verdicts on the answers that came in) goes out together when the
+   event has been handled, in a single send() on epoll or a single send operation on io_uring, see
+   sessionFlush(). That is why the sockets are TCP_NODELAY and never corked: each flush is a
+   complete exchange, and there is nothing further to wait for that corking could merge it with.
+*/
+static void sessionSend(struct worker *w, struct session *s, const void *data, int len) {
+  struct out_block *b = s->out;
+  if (b == NULL || b->len + len > b->cap) {
+    int need = (b != NULL ? b->len - b->start : 0) + len;
+    struct slab_pool *pool = need <= OUT_BLOCK_SMALL - (int)sizeof(*b) ? &w->out_small : &w->out_large;
+    if (need > OUT_BLOCK_LARGE - (int)sizeof(*b) || (b = (struct out_block *)slabAlloc(pool)) == NULL) {
+      return; // Lost, like a send() that fails
+    }
+    b->pool = pool;
+    b->start = 0;
+    b->len = 0;
+    b->cap = pool == &w->out_small ? OUT_BLOCK_SMALL - sizeof(*b) : OUT_BLOCK_LARGE - sizeof(*b);
+    if (s->out != NULL) {
+      b->len = s->out->len - s->out->start;
+      memcpy(outData(b), outData(s->out) + s->out->start, b->len);
+      slabFree(s->out->pool, s->out);
+    }
+    s->out = b;
+  }
+  memcpy(outData(b) + b->len, data, len);
+  b->len += len;
+}
+
+/* Draw an operator code and its two operands from rng. */
+static void drawAssignment(calc_rng_t *rng, int *op, double *v1, double *v2) {
+  *op = randomOp_r(rng);
+
+  if (calcOpIsFloat(*op)) {
+    *v1 = randomFloat_r(rng);
+    *v2 = randomFloat_r(rng);
+  } else {
+    int iv1 = randomInt_r(rng);
+    int iv2 = randomInt_r(rng);
+
+    if (*op == CALC_DIV) {
+      while (iv2 == 0) { // Zero divisors are never handed out
+        iv2 = randomInt_r(rng);
+      }
+    }
+    *v1 = iv1;
+    *v2 = iv2;
+  }
+}
+
+/* Draw a fresh assignment from rng, used when there is no ring or it ran dry. */
+static void makeAssignment(calc_rng_t *rng, struct assignment *a) {
+  int op;
+  double v1, v2;
+
+  drawAssignment(rng, &op, &v1, &v2);
+  renderAssignment(op, v1, v2, a);
+}
+
+/* The next assignment to hand out: from the trace with --replay, else from the ring when there is one. */
+static void nextAssignment(struct worker *w, struct assignment *a) {
+  if (w->replay != NULL) {
+    // traceReplayOpen() has checked every record, a line that does not fit is drawn anew
+    const struct trace_record *r = traceReplayNext(w->replay);
+    if (renderAssignment(r->op, r->value1, r->value2, a)) {
+      a->result = r->result; // As recorded; the operands are the ones the client saw, maybe rounded
+    } else {
+      makeAssignment(&w->rng, a);
+    }
+  } else if (w->ring == NULL || !ringPop(w->ring, a)) {
+    makeAssignment(&w->rng, a);
+  }
+}
+
+/* --record: the operands of an assignment line, as the client reads them. Assignments from the
+   ring only carry the line. */
+static void assignmentOperands(const struct assignment *a, double *v1, double *v2) {
+  const char *p = skipBlanks(a->msg + calc_ops[a->op].name_len, a->msg + a->len);
+  const char *last = a->msg + a->len;
+
+  *v1 = parseDouble(p, last);
+  p = (const char *)memchr(p, ' ', last - p);
+  *v2 = p != NULL ? parseDouble(p, last) : 0;
+}
+
+void sendAssignment(struct worker *w, struct session *s, struct expected *e) {
+  struct assignment a;
+  
+  nextAssignment(w, &a);
+  sessionSend(w, s, a.msg, a.len);
+  e->server_result = a.result;
+  e->is_float = a.is_float;
+  e->op = a.op;
+  if (w->trace != NULL) {
+    assignmentOperands(&a, &e->value1, &e->value2);
+  }
+  metricsCount(&w->metrics->assignments[a.op]);
+}
+
+/* BINARY TCP 1.0: all count assignments as records in one send. Nothing to render, so these are
+   drawn on the spot rather than taken from the ring (which holds text lines). */
+static void sendBinaryAssignments(struct worker *w, struct session *s) {
+  unsigned char records[MAX_PIPELINE * BINARY_MAX_RECORD];
+  int len = 0;
+  struct binary_record r;
+
+  r.type = BINARY_ASSIGNMENT;
+  r.result = 0;
+  for (int i = 0; i < s->count; i++) {
+    struct expected *e = &s->expected[i];
+
+    if (w->replay != NULL) {
+      const struct trace_record *t = traceReplayNext(w->replay);
+      r.op = t->op;
+      r.value1 = t->value1;
+      r.value2 = t->value2;
+      e->server_result = t->result;
+    } else {
+      drawAssignment(&w->rng, &r.op, &r.value1, &r.value2);
+      e->server_result = calcEval(r.op, r.value1, r.value2);
+    }
+    len += binaryEncode(records + len, &r);
+    e->is_float = calcOpIsFloat(r.op);
+    e->op = r.op;
+    e->value1 = r.value1;
+    e->value2 = r.value2;
+    metricsCount(&w->metrics->assignments[r.op]);
+  }
+
+  sessionSend(w, s, records, len);
+}
+
+static calc_batch_rng_t producer_rng;
+
+/* Keeps the ring full, so the workers only have to pop and send. */
+static void *runProducer(void *arg) {
+  struct assignment_ring *ring = (struct assignment_ring *)arg;
+  static int ops[PRODUCER_BATCH];
+  static double operands[2 * PRODUCER_BATCH];
+  int next = PRODUCER_BATCH;
+
+  while (1) {
+    struct assignment *a = ringReserve(ring);
+    if (a == NULL) {
+      struct timespec pause = {0, 200000}; // Full, the workers need a while to drain it
+      nanosleep(&pause, NULL);
+      continue;
+    }
+
+    if (next == PRODUCER_BATCH) {
+      randomAssignments_r(&producer_rng, PRODUCER_BATCH, ops, operands);
+      next = 0;
+    }
+
+    renderAssignment(ops[next], operands[2 * next], operands[2 * next + 1], a);
+    ringPublish(ring);
+    next++;
+  }
+
+  return NULL;
+}
+
+/*
+   io_uring operations carry what they belong to in user_data: a session or an output block
+   (both from slab pools, so the low two bits are free), tagged with the kind of operation.
+*/
+#define URING_ACCEPT 0          // the multishot accept of the listening socket
+#define URING_IGNORE 1          // close, cancel: nothing to do when they complete
+#define URING_RECV 2            // | session, its multishot recv
+#define URING_SEND 3            // | output block, back to its pool when the send completes
+#define URING_TAG_MASK 3UL
+
+/* io_uring: arm the session's multishot recv, which posts a completion with a provided buffer
+   whenever data arrives, until the peer closes, an error, or it runs out of buffers. */
+static void sessionRecv(struct worker *w, struct session *s) {
+  struct io_uring_sqe *sqe = uringGetSqe(w->uring);
+  if (sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = s->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = (unsigned long)s | URING_RECV;
+  s->recv_armed = 1;
+}
+
+/* io_uring: hand the queued output to the kernel as one send, which then owns the buffer. While
+   an earlier send is under way the output stays queued, uringSent() sends it. */
+static void uringFlush(struct worker *w, struct session *s) {
+  if (s->out == NULL || s->in_flight != NULL) {
+    return;
+  }
+
+  struct io_uring_sqe *sqe = uringGetSqe(w->uring);
+  if (sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = s->fd;
+  sqe->addr = (unsigned long)outData(s->out);
+  sqe->len = s->out->len;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->user_data = (unsigned long)s->out | URING_SEND;
+
+  s->out->session = s;
+  s->in_flight = s->out;
+  s->out = NULL;
+}
+
+/* Sends the queued output. On epoll, what the socket cannot take now (a short write, EAGAIN) stays
+   queued, and the session starts watching for EPOLLOUT, whose next edge brings it back here.
+   Sessions whose output always fits never ask for EPOLLOUT, which would otherwise wake them once
+   right after the accept. If the connection is broken the output is dropped; the read side sees
+   the error and ends the session. */
+static void sessionFlush(struct worker *w, struct session *s) {
+  if (w->uring != NULL) {
+    uringFlush(w, s);
+    return;
+  }
+
+  struct out_block *b = s->out;
+  if (b == NULL) {
+    return;
+  }
+
+  ssize_t n;
+  do {
+    n = send(s->fd, outData(b) + b->start, b->len - b->start, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+
+  if (n > 0) {
+    b->start += n;
+  }
+  if (b->start < b->len && (n > 0 || errno == EAGAIN || errno == EWOULDBLOCK)) {
+    if (!s->want_out) {
+      // Edge triggered, so having EPOLLOUT from now on only wakes us after a send came up short
+      struct epoll_event ev;
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.ptr = s;
+      epoll_ctl(w->epollfd, EPOLL_CTL_MOD, s->fd, &ev);
+      s->want_out = 1;
+    }
+    return;
+  }
+  slabFree(b->pool, b);
+  s->out = NULL;
+}
+
+/* The pool for the expected results of a pipelined session with count assignments: the smallest
+   power of two that holds them, so a session only takes the memory it uses. */
+static struct slab_pool *expectedPool(struct worker *w, int count) {
+  int i = 0;
+  while ((2 << i) < count) {
+    i++;
+  }
+  return &w->expected_pools[i];
+}
+
+static void freeSession(struct worker *w, struct session *s) {
+  if (s->task) {
+    s->task.destroy();
+  }
+  if (s->expected != &s->single) {
+    slabFree(expectedPool(w, s->count), s->expected);
+  }
+  if (s->out != NULL) {
+    slabFree(s->out->pool, s->out);
+  }
+  slabFree(&w->session_pool, s);
+}
+
+/* --record: writes a trace record for assignment i of s, which ended with outcome at now_ns. */
+static void traceAssignment(struct worker *w, struct session *s, int i, enum trace_outcome outcome, long long now_ns) {
+  const struct expected *e = &s->expected[i];
+  struct trace_record r;
+
+  memset(&r, 0, sizeof(r));
+  r.value1 = e->value1;
+  r.value2 = e->value2;
+  r.result = e->server_result;
+  r.answer = outcome == TRACE_OK || outcome == TRACE_ERROR ? e->answer : 0;
+  r.issued_ns = s->assigned_ns;
+  r.finished_ns = now_ns;
+  r.session = s->id;
+  r.index = i;
+  r.op = e->op;
+  r.outcome = outcome;
+  r.protocol = s->binary ? TRACE_BINARY : TRACE_TEXT;
+  r.worker = w->id;
+  if (!traceAppend(w->trace, &r, now_ns / 1000000)) {
+    metricsCount(&w->metrics->trace_dropped);
+  }
+}
+
+/* epoll: the end of a closed session. Closing the fd also removes it from the epoll set. */
+static void sessionRelease(struct worker *w, struct session *s) {
+  timerCancel(&w->wheel, &s->timer);
+  close(s->fd);
+  freeSession(w, s);
+}
+
+/* epoll: a closed session's socket has news while it lingers. The output goes on as the socket
+   makes room; the session goes once all of it is out, or the connection broke. Input is thrown
+   away: closing with unread input resets the connection, and the client would lose what it has
+   not read yet. */
+static void sessionLinger(struct worker *w, struct session *s) {
+  char discard[512];
+  while (read(s->fd, discard, sizeof(discard)) > 0) {
+  }
+
+  sessionFlush(w, s);
+  if (s->out == NULL) {
+    sessionRelease(w, s);
+  }
+}
+
+/* io_uring: frees a closed session once no operation refers to it any more. */
+static void uringRelease(struct worker *w, struct session *s) {
+  if (!s->lingering && !s->recv_armed && s->in_flight == NULL) {
+    freeSession(w, s);
+  }
+}
+
+/* io_uring: closes a closed session's socket, once its output is out or given up on. */
+static void uringClose(struct worker *w, struct session *s) {
+  struct io_uring_sqe *sqe = uringGetSqe(w->uring);
+  if (sqe != NULL) {
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = s->fd;
+    sqe->user_data = URING_IGNORE;
+  }
+  s->lingering = 0;
+  timerCancel(&w->wheel, &s->timer);
+
+  if (s->recv_armed) {
+    // The recv holds on to the socket (and to s) until it is cancelled; s goes when it reports back
+    sqe = uringGetSqe(w->uring);
+    if (sqe != NULL) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = (unsigned long)s | URING_RECV;
+      sqe->user_data = URING_IGNORE;
+    }
+  }
+  uringRelease(w, s);
+}
+
+/* io_uring: the send of b completed with res. Sends what the session queued meanwhile, or closes
+   it if that was the last output of a closed session. */
+static void uringSent(struct worker *w, struct out_block *b, int res) {
+  struct session *s = b->session;
+  int broken = res < b->len; // With MSG_WAITALL only a broken (or cancelled) send comes up short
+
+  slabFree(b->pool, b);
+  s->in_flight = NULL;
+  if (broken && s->out != NULL) {
+    slabFree(s->out->pool, s->out);
+    s->out = NULL;
+  }
+
+  uringFlush(w, s);
+  if (s->lingering && s->in_flight == NULL) {
+    uringClose(w, s);
+  }
+}
+
+static void closeSession(struct worker *w, struct session *s) {
+  long long now_ns = nowNs();
+  metricsRecord(w->metrics, PHASE_SESSION, now_ns - s->accepted_ns);
+  w->sessions--;
+
+  if (w->trace != NULL) {
+    // Everything answered has been graded and recorded, the rest never got an answer
+    for (int i = s->answered; i < s->count; i++) {
+      traceAssignment(w, s, i, s->timed_out ? TRACE_TIMEOUT : TRACE_CLOSED, now_ns);
+    }
+  }
+  timerCancel(&w->wheel, &s->timer);
+
+  if (w->uring == NULL) {
+    // What the socket does not take right away goes out as it makes room, see sessionLinger()
+    sessionFlush(w, s);
+    if (s->out == NULL) {
+      sessionRelease(w, s);
+      return;
+    }
+    s->lingering = 1;
+    timerArm(&w->wheel, &s->timer, nowMs() + LINGER_MS);
+    return;
+  }
+
+  // The close waits for the last output, see uringSent()
+  s->closed = 1;
+  uringFlush(w, s);
+  if (s->in_flight == NULL) {
+    uringClose(w, s);
+    return;
+  }
+  s->lingering = 1;
+  timerArm(&w->wheel, &s->timer, nowMs() + LINGER_MS);
+}
+
+/* Writes the verdict on one answer to out, returns its length. */
+static int putVerdict(char *out, int binary, int correct) {
+  if (binary) {
+    struct binary_record r = {correct ? BINARY_OK : BINARY_ERROR, 0, 0, 0, 0};
+    return binaryEncode((unsigned char *)out, &r);
+  }
+
+  const char *msg = correct ? "OK\n" : "ERROR\n";
+  int len = strlen(msg);
+  memcpy(out, msg, len);
+  return len;
+}
+
+/* Grades the answers that arrived since the last call, all in one gradeAnswers(), and sends their
+   verdicts in one go. */
+static void gradeSession(struct worker *w, struct session *s) {
+  int n = s->answered - s->graded;
+  if (n <= 0) {
+    return;
+  }
+
+  double expected[MAX_PIPELINE], answers[MAX_PIPELINE];
+  unsigned char is_float[MAX_PIPELINE];
+  unsigned long long correct[(MAX_PIPELINE + 63) / 64];
+  char verdicts[MAX_PIPELINE * 6]; // "ERROR\n" is the longest verdict
+  int len = 0;
+
+  for (int i = 0; i < n; i++) {
+    const struct expected *e = &s->expected[s->graded + i];
+    expected[i] = e->server_result;
+    answers[i] = e->answer;
+    is_float[i] = e->is_float;
+  }
+  gradeAnswers(n, expected, answers, is_float, correct);
+
+  long long now_ns = w->trace != NULL ? nowNs() : 0;
+  for (int i = 0; i < n; i++) {
+    int ok = (correct[i / 64] >> (i % 64)) & 1;
+    int op = s->expected[s->graded + i].op;
+    len += putVerdict(verdicts + len, s->binary, ok);
+    metricsCount(ok ? &w->metrics->ok[op] : &w->metrics->error[op]);
+    if (w->trace != NULL) {
+      traceAssignment(w, s, s->graded + i, ok ? TRACE_OK : TRACE_ERROR, now_ns);
+    }
+  }
+  sessionSend(w, s, verdicts, len);
+
+  s->graded = s->answered;
+}
+
+/* "ERROR TO", as a record once the client has switched to binary. */
+static void sendTimeout(struct worker *w, struct session *s) {
+  if (s->binary) {
+    unsigned char record[BINARY_MAX_RECORD];
+    struct binary_record r = {BINARY_TIMEOUT, 0, 0, 0, 0};
+    sessionSend(w, s, record, binaryEncode(record, &r));
+  } else {
+    const char *timeout_msg = "ERROR TO\n";
+    sessionSend(w, s, timeout_msg, strlen(timeout_msg));
+  }
+}
+
+/* Parses a "<prefix><N>" frame like "TEXT TCP 1.1 <N>", returns N or 0 if it is not a valid request. */
+static int pipelineRequest(std::string_view frame, std::string_view prefix) {
+  if (frame.substr(0, prefix.size()) != prefix) {
+    return 0;
+  }
+
+  const char *last = frame.data() + frame.size();
+  int count = 0;
+  std::from_chars_result r = std::from_chars(frame.data() + prefix.size(), last, count);
+  if (r.ec != std::errc() || r.ptr != last || count < 1 || count > MAX_PIPELINE) {
+    return 0;
+  }
+  return count;
+}
+
+/* The next complete frame in the session's buffer: lines, or records once a binary session has been
+   set up. */
+static bool nextFrame(struct session *s, std::string_view *frame) {
+  if (s->binary) {
+    return binaryNextRecord(&s->in, frame);
+  }
+  return lineReaderNext(&s->in, frame);
+}
+
+/*
+   co_await recvFrame(w, s, deadline_ms) in runSession() gives the session's next event: the next
+   frame in s->frame, SESSION_TIMEOUT if none arrived by deadline_ms, or SESSION_CLOSED. A frame
+   that is already in the buffer is handed out without suspending. Otherwise the answers taken so
+   far are graded first, all together, since nothing more can come in before the next read; then
+   the deadline is armed and the session waits for the event loop.
+*/
+struct frame_wait {
+  struct worker *w;
+  struct session *s;
+  long long deadline_ms;
+
+  bool await_ready() {
+    if (!nextFrame(s, &s->frame)) {
+      return false;
+    }
+    s->event = SESSION_FRAME;
+    return true;
+  }
+
+  void await_suspend(std::coroutine_handle<>) {
+    gradeSession(w, s);
+    timerArm(&w->wheel, &s->timer, deadline_ms);
+  }
+
+  int await_resume() { return s->event; }
+};
+
+static struct frame_wait recvFrame(struct worker *w, struct session *s, long long deadline_ms) {
+  return frame_wait{w, s, deadline_ms};
+}
+
+/* One client, from the greeting to the last verdict. Returning ends the session, sessionResume()
+   closes it. */
+static session_task runSession(struct worker *w, struct session *s) {
+  const char *protocol_msg = w->eager ? EAGER_GREETING : GREETING;
+  sessionSend(w, s, protocol_msg, strlen(protocol_msg));
+  s->greeted_ns = nowNs();
+  metricsRecord(w->metrics, PHASE_ACCEPT_TO_GREETING, s->greeted_ns - s->accepted_ns);
+
+  if (w->eager) {
+    s->count = 1;
+    sendAssignment(w, s, &s->expected[0]);
+    s->assigned_ns = s->greeted_ns;
+  }
+
+  // Wait for the client to pick a protocol
+  int event = co_await recvFrame(w, s, nowMs() + SESSION_TIMEOUT_MS);
+  if (event == SESSION_TIMEOUT) {
+    metricsCount(&w->metrics->handshake_timeouts);
+    sendTimeout(w, s);
+    s->timed_out = 1;
+  }
+  if (event != SESSION_FRAME) {
+    co_return;
+  }
+
+  metricsRecord(w->metrics, PHASE_GREETING_TO_CHOICE, nowNs() - s->greeted_ns);
+
+  int count = 1;
+  if (w->eager) {
+    if (s->frame != "OK") {
+      co_return;
+    }
+  } else if (s->frame == "BINARY TCP 1.0") {
+    s->binary = 1;
+  } else if (s->frame != "OK") {
+    count = pipelineRequest(s->frame, "TEXT TCP 1.1 ");
+    if (count == 0) {
+      count = pipelineRequest(s->frame, "BINARY TCP 1.0 ");
+      s->binary = 1;
+    }
+    if (count == 0) {
+      co_return;
+    }
+
+    s->pipelined = 1;
+    if (count > 1) {
+      s->expected = (struct expected *)slabAlloc(expectedPool(w, count));
+      if (s->expected == NULL) {
+        s->expected = &s->single;
+        co_return;
+      }
+    }
+  }
+
+  // After connection, send random assignment(s), unless it went with the greeting
+  if (!w->eager) {
+    s->count = count;
+    if (s->binary) {
+      sendBinaryAssignments(w, s);
+    } else {
+      for (int i = 0; i < count; i++) {
+        sendAssignment(w, s, &s->expected[i]);
+      }
+    }
+    s->assigned_ns = nowNs();
+  }
+
+  // So basically, let's wait 5secs for an answer, starting over whenever one arrives. One verdict
+  // per answer, in order; TEXT TCP 1.0 is the same with a count of one.
+  long long deadline_ms = nowMs() + SESSION_TIMEOUT_MS;
+  while (s->answered < s->count) {
+    event = co_await recvFrame(w, s, deadline_ms);
+    if (event == SESSION_TIMEOUT) {
+      metricsCount(&w->metrics->timeouts[s->expected[s->answered].op]);
+      sendTimeout(w, s);
+      s->timed_out = 1;
+    }
+    if (event != SESSION_FRAME) {
+      co_return;
+    }
+
+    struct expected *e = &s->expected[s->answered];
+    if (s->binary) {
+      struct binary_record r;
+      if (!binaryDecode((const unsigned char *)s->frame.data(), s->frame.size(), &r) || r.type != BINARY_ANSWER) {
+        break; // Verdicts on what came before it, then close
+      }
+      e->answer = r.result;
+    } else {
+      e->answer = parseDouble(s->frame.data(), s->frame.data() + s->frame.size());
+    }
+
+    long long now_ns = nowNs();
+    metricsRecord(w->metrics, PHASE_ASSIGNMENT_TO_ANSWER, now_ns - s->assigned_ns);
+    s->answered++;
+    deadline_ms = now_ns / 1000000 + SESSION_TIMEOUT_MS;
+  }
+
+  gradeSession(w, s);
+}
+
+/* Resumes the session's coroutine with event. Returns 0 if that ended the session, which is then
+   closed. */
+static int sessionResume(struct worker *w, struct session *s, enum session_event event) {
+  s->event = event;
+  s->task.resume();
+  if (!s->task.done()) {
+    return 1;
+  }
+
+  closeSession(w, s);
+  return 0;
+}
+
+static void openSession(struct worker *w, int clientfd) {
+  metricsCount(&w->metrics->accepts);
+
+  if (w->max_sessions > 0 && w->sessions >= w->max_sessions) {
+    // A fresh socket's buffer always has room for this, so neither call can block
+    send(clientfd, BUSY, strlen(BUSY), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(clientfd);
+    metricsCount(&w->metrics->shed);
+    return;
+  }
+
+  struct session *s = (struct session *)slabAlloc(&w->session_pool);
+  if (s == NULL) {
+    close(clientfd);
+    return;
+  }
+
+  // All but the buffers, which need no clearing
+  memset((void *)s, 0, offsetof(struct session, in));
+  memset(&s->single, 0, sizeof(*s) - offsetof(struct session, single));
+  s->fd = clientfd;
+  s->expected = &s->single;
+  lineReaderInit(&s->in);
+  s->accepted_ns = nowNs();
+  s->id = ++w->last_session;
+  w->sessions++;
+
+  // Every flush is a complete exchange, don't let Nagle hold one back waiting for an ACK
+  int yes = 1;
+  setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+  if (w->sndbuf > 0) {
+    setsockopt(clientfd, SOL_SOCKET, SO_SNDBUF, &w->sndbuf, sizeof(w->sndbuf));
+  }
+
+  if (w->uring != NULL) {
+    sessionRecv(w, s);
+  } else {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = s;
+    if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, clientfd, &ev) == -1) {
+      closeSession(w, s);
+      return;
+    }
+  }
+
+  // Runs up to the wait for the client's protocol choice
+  s->task = runSession(w, s).handle;
+  if (!s->task) {
+    closeSession(w, s);
+    return;
+  }
+  sessionFlush(w, s);
+}
+
+static void acceptClients(struct worker *w) {
+  // Edge triggered, so keep accepting until the backlog is empty
+  while (1) {
+    int clientfd = accept4(w->listenfd, NULL, NULL, SOCK_NONBLOCK); // The peer's address is never used
+    if (clientfd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      return; // EAGAIN, or out of fds; we get another edge on the next connection
+    }
+
+    openSession(w, clientfd);
+  }
+}
+
+static void sessionExpired(struct timer_node *node, void *arg) {
+  struct worker *w = (struct worker *)arg;
+  struct session *s = (struct session *)((char *)node - offsetof(struct session, timer));
+
+  if (s->lingering && w->uring == NULL) {
+    sessionRelease(w, s); // The client is not reading, what is left is lost
+    return;
+  }
+  if (s->lingering) {
+    // Likewise; the cancelled send completes short, and uringSent() closes the session
+    struct io_uring_sqe *sqe = uringGetSqe(w->uring);
+    if (sqe != NULL) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = (unsigned long)s->in_flight | URING_SEND;
+      sqe->user_data = URING_IGNORE;
+    }
+    timerArm(&w->wheel, &s->timer, nowMs() + LINGER_MS); // Again, should the cancel not get through
+    return;
+  }
+  sessionResume(w, s, SESSION_TIMEOUT);
+}
+
+/* Run the timerfd only while there is something on the wheel, so an idle worker sleeps. */
+static void updateTimerfd(struct worker *w) {
+  int want = w->wheel.count > 0;
+  if (want == w->timer_running) {
+    return;
+  }
+
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (want) {
+    its.it_value.tv_nsec = TIMER_TICK_MS * 1000000L;
+    its.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
+  }
+  timerfd_settime(w->timerfd, 0, &its, NULL);
+  w->timer_running = want;
+}
+
+static void timerTick(struct worker *w) {
+  unsigned long long expirations;
+  // We only need to clear the readiness, timerAdvance() works from the clock
+  while (read(w->timerfd, &expirations, sizeof(expirations)) > 0) {
+  }
+  timerAdvance(&w->wheel, nowMs(), sessionExpired, w);
+}
+
+/* Hands the session's coroutine the next complete frame in the buffer, if there is one; it takes
+   any further frames on its own. Returns 0 if the session was closed. */
+static int sessionFrames(struct worker *w, struct session *s) {
+  if (!nextFrame(s, &s->frame)) {
+    return 1;
+  }
+  return sessionResume(w, s, SESSION_FRAME);
+}
+
+/* epoll: the session's socket has news. Handles everything that arrived; returns 0 if that ended
+   the session. */
+static int sessionReadable(struct worker *w, struct session *s) {
+  // Edge triggered, so keep going until the socket is drained. TCP is a byte stream: a read
+  // can end in the middle of a line or hold several, the line buffer sorts that out.
+  while (1) {
+    if (!sessionFrames(w, s)) {
+      return 0;
+    }
+
+    if (lineReaderFull(&s->in)) {
+      // A line longer than we accept, nobody speaking our protocol sends that
+      sessionResume(w, s, SESSION_CLOSED);
+      return 0;
+    }
+
+    ssize_t n = lineReaderFill(&s->in, s->fd);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      // Gone (whatever is left is an unterminated line), or broken
+      sessionResume(w, s, SESSION_CLOSED);
+      return 0;
+    }
+    if (n < 0) {
+      return 1; // Drained, wait for the next edge
+    }
+  }
+}
+
+/* io_uring: len bytes the kernel received for s, the counterpart of sessionReadable(). Returns 0
+   if the session was closed. */
+static int sessionData(struct worker *w, struct session *s, const char *data, size_t len) {
+  while (1) {
+    size_t n = lineReaderAppend(&s->in, data, len);
+    data += n;
+    len -= n;
+
+    if (!sessionFrames(w, s)) {
+      return 0;
+    }
+    if (len == 0) {
+      return 1;
+    }
+    if (lineReaderFull(&s->in)) {
+      sessionResume(w, s, SESSION_CLOSED);
+      return 0;
+    }
+  }
+}
+
+static unsigned char cookie_key[SIP_HASH_KEY_SIZE]; // Random per run, shared by all workers
+
+static void putLe64(unsigned char *p, unsigned long long v) {
+  for (int i = 0; i < 8; i++) {
+    p[i] = v >> (8 * i);
+  }
+}
+
+static unsigned long long getLe64(const unsigned char *p) {
+  unsigned long long v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (unsigned long long)p[i] << (8 * i);
+  }
+  return v;
+}
+
+/* MAC over the first 16 cookie bytes and the peer's address and port, so a cookie only verifies
+   for the client it was made for. */
+static unsigned long long cookieMac(const unsigned char *fields, const struct sockaddr_storage *peer) {
+  unsigned char msg[16 + 16 + 2];
+  int len = 16;
+
+  memcpy(msg, fields, 16);
+  if (peer->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)peer;
+    memcpy(msg + len, &a->sin6_addr, 16);
+    len += 16;
+    memcpy(msg + len, &a->sin6_port, 2);
+  } else {
+    const struct sockaddr_in *a = (const struct sockaddr_in *)peer;
+    memcpy(msg + len, &a->sin_addr, 4);
+    len += 4;
+    memcpy(msg + len, &a->sin_port, 2);
+  }
+  len += 2;
+
+  return sipHash24(cookie_key, msg, len);
+}
+
+/* Writes the cookie as hex digits to out, returns the length. */
+static int makeCookie(char *out, const struct assignment *a, long long deadline_ms, const struct sockaddr_storage *peer) {
+  static const char hex[] = "0123456789abcdef";
+  unsigned char cookie[COOKIE_SIZE];
+  unsigned long long result_bits;
+
+  memcpy(&result_bits, &a->result, sizeof(result_bits));
+  putLe64(cookie, result_bits);
+  putLe64(cookie + 8, ((unsigned long long)deadline_ms << (COOKIE_OP_BITS + 1)) | a->op << 1 | a->is_float);
+  putLe64(cookie + 16, cookieMac(cookie, peer));
+
+  for (int i = 0; i < COOKIE_SIZE; i++) {
+    out[2 * i] = hex[cookie[i] >> 4];
+    out[2 * i + 1] = hex[cookie[i] & 15];
+  }
+  return 2 * COOKIE_SIZE;
+}
+
+static int hexDigit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+/* Unpacks a cookie made by makeCookie() for peer. Returns 0 if it is malformed or forged. */
+static int checkCookie(std::string_view text, const struct sockaddr_storage *peer, struct expected *e, long long *deadline_ms) {
+  unsigned char cookie[COOKIE_SIZE];
+
+  if (text.size() != 2 * COOKIE_SIZE) {
+    return 0;
+  }
+  for (int i = 0; i < COOKIE_SIZE; i++) {
+    int high = hexDigit(text[2 * i]);
+    int low = hexDigit(text[2 * i + 1]);
+    if (high < 0 || low < 0) {
+      return 0;
+    }
+    cookie[i] = high << 4 | low;
+  }
+
+  if (getLe64(cookie + 16) != cookieMac(cookie, peer)) {
+    return 0;
   }
-  
-  send(clientfd, msg, strlen(msg), 0);
+
+  unsigned long long result_bits = getLe64(cookie);
+  unsigned long long deadline = getLe64(cookie + 8);
+  memcpy(&e->server_result, &result_bits, sizeof(result_bits));
+  e->is_float = deadline & 1;
+  e->op = (deadline >> 1) & ((1 << COOKIE_OP_BITS) - 1);
+  *deadline_ms = deadline >> (COOKIE_OP_BITS + 1);
+  return 1;
 }
 
-int main(int argc, char *argv[]){
-  
-  char delim[]=":";
-  char *Desthost=strtok(argv[1],delim);
-  char *Destport=strtok(NULL,delim);
+/* --record: a TEXT UDP 1.0 assignment as it goes out. The verdict comes back to a server that
+   has forgotten the assignment, so that is all the trace gets. */
+static void traceUdpAssignment(struct worker *w, const struct assignment *a) {
+  struct trace_record r;
+  long long now_ns = nowNs();
 
-  int port=atoi(Destport);
-#ifdef DEBUG  
-  printf("Host %s, and port %d.\n",Desthost,port);
+  memset(&r, 0, sizeof(r));
+  assignmentOperands(a, &r.value1, &r.value2);
+  r.result = a->result;
+  r.issued_ns = now_ns;
+  r.op = a->op;
+  r.outcome = TRACE_SENT;
+  r.protocol = TRACE_UDP;
+  r.worker = w->id;
+  if (!traceAppend(w->trace, &r, now_ns / 1000000)) {
+    metricsCount(&w->metrics->trace_dropped);
+  }
+}
+
+/* The answers of one recvmmsg() batch, graded together once the whole batch has been read. */
+struct udp_grading {
+  int count;
+  int reply[UDP_BATCH];       // which of the batch's replies gets the verdict
+  int op[UDP_BATCH];
+  double expected[UDP_BATCH];
+  double answers[UDP_BATCH];
+  unsigned char is_float[UDP_BATCH];
+};
+
+#define UDP_GRADE -1            // udpDatagram(): the reply is the verdict, see udp_grading
+
+/* One datagram from peer. Writes the reply to out and returns its length, 0 for no reply, or
+   UDP_GRADE if it is an answer in time, which is added to grading as reply number reply. */
+static int udpDatagram(struct worker *w, std::string_view msg, const struct sockaddr_storage *peer, long long now_ms, char *out,
+                       struct udp_grading *grading, int reply) {
+  if (msg.substr(0, strlen(UDP_REQUEST)) == UDP_REQUEST) {
+    if (msg.size() < UDP_REQUEST_MIN) {
+      return 0;
+    }
+
+    struct assignment a;
+    nextAssignment(w, &a);
+    metricsCount(&w->metrics->assignments[a.op]);
+    if (w->trace != NULL) {
+      traceUdpAssignment(w, &a);
+    }
+
+    memcpy(out, a.msg, a.len);
+    int len = a.len;
+    len += makeCookie(out + len, &a, now_ms + SESSION_TIMEOUT_MS, peer);
+    out[len++] = '\n';
+    return len;
+  }
+
+  // "<cookie>\n<answer>\n"
+  size_t newline = msg.find('\n');
+  if (newline == std::string_view::npos) {
+    return 0;
+  }
+
+  struct expected e;
+  long long deadline_ms;
+  if (!checkCookie(msg.substr(0, newline), peer, &e, &deadline_ms)) {
+    return 0;
+  }
+
+  if (now_ms > deadline_ms) {
+    const char *verdict = "ERROR TO\n";
+    metricsCount(&w->metrics->timeouts[e.op]);
+    memcpy(out, verdict, strlen(verdict));
+    return strlen(verdict);
+  }
+
+  std::string_view answer = msg.substr(newline + 1);
+  answer = answer.substr(0, answer.find('\n'));
+
+  int i = grading->count++;
+  grading->reply[i] = reply;
+  grading->op[i] = e.op;
+  grading->expected[i] = e.server_result;
+  grading->answers[i] = parseDouble(answer.data(), answer.data() + answer.size());
+  grading->is_float[i] = e.is_float;
+  return UDP_GRADE;
+}
+
+/* Reads the UDP socket dry, up to UDP_BATCH datagrams per recvmmsg(), and sends the replies to
+   each batch with one sendmmsg(). */
+static void udpReadable(struct worker *w) {
+  struct mmsghdr in[UDP_BATCH], out[UDP_BATCH];
+  struct iovec in_iov[UDP_BATCH], out_iov[UDP_BATCH];
+  struct sockaddr_storage peers[UDP_BATCH];
+  char in_buf[UDP_BATCH][UDP_DATAGRAM_MAX];
+  char out_buf[UDP_BATCH][UDP_REPLY_MAX];
+
+  memset(in, 0, sizeof(in));
+  memset(out, 0, sizeof(out));
+  for (int i = 0; i < UDP_BATCH; i++) {
+    in_iov[i].iov_base = in_buf[i];
+    in_iov[i].iov_len = sizeof(in_buf[i]);
+    in[i].msg_hdr.msg_iov = &in_iov[i];
+    in[i].msg_hdr.msg_iovlen = 1;
+    in[i].msg_hdr.msg_name = &peers[i];
+    out[i].msg_hdr.msg_iov = &out_iov[i];
+    out[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (1) {
+    for (int i = 0; i < UDP_BATCH; i++) {
+      in[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+    }
+
+    int n = recvmmsg(w->listenfd, in, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return; // EAGAIN, drained
+    }
+
+    long long now = nowMs();
+    int replies = 0;
+    struct udp_grading grading;
+    grading.count = 0;
+
+    for (int i = 0; i < n; i++) {
+      std::string_view msg(in_buf[i], in[i].msg_len);
+      int len = udpDatagram(w, msg, &peers[i], now, out_buf[replies], &grading, replies);
+      if (len == 0) {
+        continue;
+      }
+
+      out_iov[replies].iov_base = out_buf[replies];
+      out_iov[replies].iov_len = len;
+      out[replies].msg_hdr.msg_name = &peers[i];
+      out[replies].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+      replies++;
+    }
+
+    // Now the verdicts on every answer in the batch
+    unsigned long long correct[(UDP_BATCH + 63) / 64];
+    gradeAnswers(grading.count, grading.expected, grading.answers, grading.is_float, correct);
+    for (int i = 0; i < grading.count; i++) {
+      int ok = (correct[i / 64] >> (i % 64)) & 1;
+      int reply = grading.reply[i];
+      out_iov[reply].iov_len = putVerdict(out_buf[reply], 0, ok);
+      metricsCount(ok ? &w->metrics->ok[grading.op[i]] : &w->metrics->error[grading.op[i]]);
+    }
+
+    int sent = 0;
+    while (sent < replies) {
+      int r = sendmmsg(w->listenfd, out + sent, replies - sent, 0);
+      if (r == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break; // Socket buffer full, the clients will see these as lost
+      }
+      sent += r;
+    }
+
+    if (n < UDP_BATCH) {
+      return; // Short batch, the queue was empty; anything newer comes with a new edge
+    }
+  }
+}
+
+/* How long the event loop may sleep with nothing to do: for good, unless --record has records
+   waiting to be handed to the trace thread (traceFlush()). */
+static int idleWaitMs(struct worker *w) {
+  return w->trace != NULL && tracePending(w->trace) ? TRACE_FLUSH_MS : -1;
+}
+
+/* io_uring: (re)arm the multishot accept, which posts one completion per new connection. */
+static void uringAccept(struct worker *w) {
+  struct io_uring_sqe *sqe = uringGetSqe(w->uring);
+  if (sqe == NULL) {
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = w->listenfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = URING_ACCEPT;
+}
+
+/* io_uring: a completion of the session's multishot recv. */
+static void uringReceived(struct worker *w, struct session *s, int res, unsigned flags) {
+  int more = flags & IORING_CQE_F_MORE;
+  const char *data = NULL;
+
+  if (!more) {
+    s->recv_armed = 0;
+  }
+  if (flags & IORING_CQE_F_BUFFER) {
+    unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    data = uringBuffer(w->uring, bid);
+    // The data is copied out below before anything can be received into the buffer again
+    uringRecycleBuffer(w->uring, bid);
+  }
+
+  if (s->closed) {
+    // Input that comes in while the session lingers is thrown away, as on epoll (sessionLinger())
+    uringRelease(w, s);
+    return;
+  }
+
+  if (res == -ENOBUFS) {
+    sessionRecv(w, s); // Every buffer was in use, they are back by now
+    return;
+  }
+  if (res <= 0) {
+    // Gone (whatever is left is an unterminated line), or broken
+    sessionResume(w, s, SESSION_CLOSED);
+    return;
+  }
+
+  if (!sessionData(w, s, data, res)) {
+    return;
+  }
+  if (!s->recv_armed) {
+    sessionRecv(w, s);
+  }
+  sessionFlush(w, s);
+}
+
+/*
+   The io_uring event loop. Accepts, receives, sends and closes are all operations on the ring,
+   so one io_uring_enter() per loop submits everything the last round of completions produced and
+   waits for the next ones. Session logic is the same as on epoll; only where the bytes come from
+   (sessionData()) and how they leave (sessionSend()) differ.
+*/
+static void runUring(struct worker *w) {
+  uringAccept(w);
+
+  while (1) {
+    // Wake up for the timer wheel while any session has a deadline
+    int rv = uringSubmitAndWait(w->uring, w->wheel.count > 0 ? TIMER_TICK_MS : idleWaitMs(w));
+    if (rv < 0 && rv != -ETIME && rv != -EINTR && rv != -EBUSY) {
+      printf("io_uring_enter failed\n");
+      break;
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uringPeekCqe(w->uring)) != NULL) {
+      unsigned long data = cqe->user_data;
+      int res = cqe->res;
+      unsigned flags = cqe->flags;
+      uringCqeSeen(w->uring);
+
+      switch (data & URING_TAG_MASK) {
+      case URING_ACCEPT:
+        if (res >= 0) {
+          openSession(w, res);
+        }
+        if (!(flags & IORING_CQE_F_MORE)) {
+          uringAccept(w);
+        }
+        break;
+      case URING_RECV:
+        uringReceived(w, (struct session *)(data & ~URING_TAG_MASK), res, flags);
+        break;
+      case URING_SEND:
+        uringSent(w, (struct out_block *)(data & ~URING_TAG_MASK), res);
+        break;
+      }
+    }
+
+    if (w->wheel.count > 0) {
+      timerAdvance(&w->wheel, nowMs(), sessionExpired, w);
+    }
+    if (w->trace != NULL) {
+      traceFlush(w->trace, nowMs());
+    }
+  }
+}
+
+/* Sets up io_uring for w on the calling thread, the only one that may submit to the ring.
+   Returns 0, or -1 and leaves w on epoll. */
+static int openUring(struct worker *w) {
+  w->uring = (struct uring *)malloc(sizeof(struct uring));
+  int rv = w->uring != NULL ? uringInit(w->uring, URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE) : -ENOMEM;
+  if (rv != 0) {
+    printf("Worker %d: io_uring not available (%s), using epoll\n", w->id, strerror(-rv));
+    free(w->uring);
+    w->uring = NULL;
+    return -1;
+  }
+
+  // io_uring waits for the socket itself; with O_NONBLOCK it would hand us EAGAIN instead
+  fcntl(w->listenfd, F_SETFL, fcntl(w->listenfd, F_GETFL) & ~O_NONBLOCK);
+#ifdef DEBUG
+  printf("Worker %d: io_uring\n", w->id);
 #endif
+  return 0;
+}
+
+static void *runWorker(void *arg) {
+  struct worker *w = (struct worker *)arg;
+
+  initCalcLib_r(&w->rng, w->seed);
+
+  if (w->want_uring && openUring(w) == 0) {
+    runUring(w);
+    return NULL;
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+
+  while (1) {
+    int n = epoll_wait(w->epollfd, events, MAX_EVENTS, idleWaitMs(w));
+    if (n == -1 && errno != EINTR) {
+      printf("epoll_wait failed\n");
+      break;
+    }
+
+    // Expired sessions are closed and freed, and events further down this batch may still point
+    // at them, so the wheel only turns once the batch is done
+    int ticked = 0;
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL && w->udp) {
+        udpReadable(w);
+      } else if (events[i].data.ptr == NULL) {
+        acceptClients(w);
+      } else if (events[i].data.ptr == &w->wheel) {
+        ticked = 1;
+      } else {
+        // One send for everything the event produced, or what is left of an earlier one
+        struct session *s = (struct session *)events[i].data.ptr;
+        if (s->lingering) {
+          sessionLinger(w, s);
+        } else if (sessionReadable(w, s)) {
+          sessionFlush(w, s);
+        }
+      }
+    }
+    if (ticked) {
+      timerTick(w);
+    }
 
-  initCalcLib();
+    updateTimerfd(w);
+    if (w->trace != NULL) {
+      traceFlush(w->trace, nowMs());
+    }
+  }
+
+  return NULL;
+}
 
+/* Create, bind and register the listening socket of one worker. Returns 0 on success. */
+static int openWorker(struct worker *w, const char *host, const char *port, int reuseport, int backlog) {
   struct addrinfo hints, *servinfo;
-  int sockfd;
-  
+
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_socktype = w->udp ? SOCK_DGRAM : SOCK_STREAM;
   hints.ai_flags = AI_PASSIVE;
-  
-  int rv = getaddrinfo(Desthost, Destport, &hints, &servinfo);
+
+  int rv = getaddrinfo(host, port, &hints, &servinfo);
   if (rv != 0) {
     printf("getaddrinfo error: %s\n", gai_strerror(rv));
-    return 1;
+    return -1;
   }
-  
-  sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-  if (sockfd == -1) {
+
+  w->listenfd = socket(servinfo->ai_family, servinfo->ai_socktype | SOCK_NONBLOCK, servinfo->ai_protocol);
+  if (w->listenfd == -1) {
     printf("Socket creation failed\n");
     freeaddrinfo(servinfo);
-    return 1;
+    return -1;
   }
-  
+
   int yes = 1;
-  if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) { 
+  if (setsockopt(w->listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
     printf("setsockopt failed\n");
-    close(sockfd);
+    close(w->listenfd);
     freeaddrinfo(servinfo);
-    return 1;
+    return -1;
   }
-  
-  if (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+
+  if (reuseport && setsockopt(w->listenfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+    printf("setsockopt SO_REUSEPORT failed\n");
+    close(w->listenfd);
+    freeaddrinfo(servinfo);
+    return -1;
+  }
+
+  if (bind(w->listenfd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
     printf("Bind failed\n");
-    close(sockfd);
+    close(w->listenfd);
     freeaddrinfo(servinfo);
-    return 1;
+    return -1;
   }
-  
+
   freeaddrinfo(servinfo);
-  
-  if (listen(sockfd, 5) == -1) {
+
+  if (!w->udp && listen(w->listenfd, backlog) == -1) {
     printf("Listen failed\n");
-    close(sockfd);
+    close(w->listenfd);
+    return -1;
+  }
+
+  w->epollfd = epoll_create1(0);
+  if (w->epollfd == -1) {
+    printf("epoll_create1 failed\n");
+    close(w->listenfd);
+    return -1;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL; // NULL marks the listening socket, sessions carry their own pointer
+  if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->listenfd, &ev) == -1) {
+    printf("epoll_ctl failed\n");
+    close(w->epollfd);
+    close(w->listenfd);
+    return -1;
+  }
+
+  w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (w->timerfd == -1) {
+    printf("timerfd_create failed\n");
+    close(w->epollfd);
+    close(w->listenfd);
+    return -1;
+  }
+  w->timer_running = 0;
+  timerWheelInit(&w->wheel, nowMs(), TIMER_TICK_MS);
+
+  slabPoolInit(&w->session_pool, sizeof(struct session));
+  for (int i = 0; i < EXPECTED_POOLS; i++) {
+    slabPoolInit(&w->expected_pools[i], (2 << i) * sizeof(struct expected));
+  }
+  slabPoolInit(&w->out_small, OUT_BLOCK_SMALL);
+  slabPoolInit(&w->out_large, OUT_BLOCK_LARGE);
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = &w->wheel;
+  if (epoll_ctl(w->epollfd, EPOLL_CTL_ADD, w->timerfd, &ev) == -1) {
+    printf("epoll_ctl failed\n");
+    close(w->timerfd);
+    close(w->epollfd);
+    close(w->listenfd);
+    return -1;
+  }
+
+  return 0;
+}
+
+static struct worker_metrics metrics[MAX_WORKERS];
+static int stats_fd = -1;
+static int stats_workers;
+
+static void *runStats(void *arg) {
+  metricsServe(stats_fd, metrics, stats_workers);
+  return NULL;
+}
+
+static struct trace_buffer trace_buffers[MAX_WORKERS];
+static int trace_fd = -1;
+static int trace_workers;
+
+static void *runTrace(void *arg) {
+  traceWriterRun(trace_fd, trace_buffers, trace_workers);
+  exit(0); // Stopped with a complete trace
+  return NULL;
+}
+
+/* Without --record: waits for SIGINT or SIGTERM and ends the server with exit(), so what runs at
+   exit still does (an instrumented build from "make pgo" writes its profile then). */
+static void *runStop(void *arg) {
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+
+  int sig;
+  sigwait(&stop, &sig);
+  exit(0);
+  return NULL;
+}
+
+/* Listening socket for --stats, on the server's host. Returns the fd or -1. */
+static int openStats(const char *host, const char *port) {
+  struct addrinfo hints, *servinfo;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  int rv = getaddrinfo(host, port, &hints, &servinfo);
+  if (rv != 0) {
+    printf("getaddrinfo error: %s\n", gai_strerror(rv));
+    return -1;
+  }
+
+  int fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+  int yes = 1;
+  if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+      bind(fd, servinfo->ai_addr, servinfo->ai_addrlen) == -1 || listen(fd, 16) == -1) {
+    printf("Stats socket failed\n");
+    if (fd != -1) {
+      close(fd);
+    }
+    freeaddrinfo(servinfo);
+    return -1;
+  }
+
+  freeaddrinfo(servinfo);
+  return fd;
+}
+
+int main(int argc, char *argv[]){
+
+  if (argc < 2) {
+    printf("Usage: %s <host:port> [--workers N] [--seed S] [--ring SIZE] [--udp] [--stats PORT] [--uring]\n"
+           "       [--backlog N] [--max-sessions N] [--record FILE | --replay FILE] [--eager] [--sndbuf BYTES]\n", argv[0]);
     return 1;
   }
-  
+
+  int nworkers = 1;
+  unsigned long ring_size = 0;
+  int udp = 0;
+  int uring = 0;
+  int backlog = DEFAULT_BACKLOG;
+  int max_sessions = 0;
+  int eager = 0;
+  int sndbuf = 0;
+  const char *stats_port = NULL;
+  const char *record_path = NULL;
+  const char *replay_path = NULL;
+  unsigned long long seed = (unsigned long long)time(NULL);
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      nworkers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc) {
+      ring_size = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--udp") == 0) {
+      udp = 1;
+    } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      stats_port = argv[++i];
+    } else if (strcmp(argv[i], "--uring") == 0) {
+      uring = 1;
+    } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+      backlog = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc) {
+      max_sessions = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      record_path = argv[++i];
+    } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--eager") == 0) {
+      eager = 1;
+    } else if (strcmp(argv[i], "--sndbuf") == 0 && i + 1 < argc) {
+      sndbuf = atoi(argv[++i]);
+    } else {
+      printf("Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (nworkers < 1 || nworkers > MAX_WORKERS) {
+    printf("--workers must be between 1 and %d\n", MAX_WORKERS);
+    return 1;
+  }
+  if (backlog < 1 || max_sessions < 0 || sndbuf < 0) {
+    printf("--backlog must be at least 1, --max-sessions and --sndbuf at least 0\n");
+    return 1;
+  }
+  if (replay_path != NULL && (record_path != NULL || ring_size > 0)) {
+    printf("--replay does not go with --record or --ring\n");
+    return 1;
+  }
+
+  char delim[]=":";
+  char *Desthost=strtok(argv[1],delim);
+  char *Destport=strtok(NULL,delim);
+
+  if (Destport == NULL) {
+    printf("Invalid host:port format\n");
+    return 1;
+  }
+
+  int port=atoi(Destport);
 #ifdef DEBUG
-  printf("Server listening on %s:%d\n", Desthost, port);
+  printf("Host %s, and port %d.\n",Desthost,port);
 #endif
 
-  while (1) {
-    struct sockaddr_storage client_addr;
-    socklen_t addr_size = sizeof(client_addr);
-    
-    int clientfd = accept(sockfd, (struct sockaddr *)&client_addr, &addr_size);
-    if (clientfd == -1) {
-      continue;
+  static struct worker workers[MAX_WORKERS];
+  static struct assignment_ring ring;
+
+  if (ring_size > 0) {
+    if (ringInit(&ring, ring_size) != 0) {
+      printf("--ring must be a power of two\n");
+      return 1;
     }
-    
-    const char *protocol_msg = "TEXT TCP 1.0\n\n";
-    send(clientfd, protocol_msg, strlen(protocol_msg), 0);
-    
-    fd_set readfds;
-    struct timeval timeout;
-    
-    FD_ZERO(&readfds);
-    FD_SET(clientfd, &readfds);
-    timeout.tv_sec = 5;
-    timeout.tv_usec = 0;
-    
-    int select_result = select(clientfd + 1, &readfds, NULL, NULL, &timeout);
-    
-    if (select_result == 0) {
-      const char *timeout_msg = "ERROR TO\n";
-      send(clientfd, timeout_msg, strlen(timeout_msg), 0);
-      close(clientfd);
-      continue;
+    initCalcBatch_r(&producer_rng, seed + nworkers);
+#ifdef DEBUG
+    printf("Assignment ring of %lu, producer seed %llu\n", ring_size, seed + nworkers);
+#endif
+  }
+
+  if (udp && getrandom(cookie_key, sizeof(cookie_key), 0) != sizeof(cookie_key)) {
+    printf("getrandom failed\n");
+    return 1;
+  }
+
+  static struct trace_replay replay;
+
+  if (replay_path != NULL) {
+    if (traceReplayOpen(&replay, replay_path) != 0) {
+      printf("--replay %s: %s\n", replay_path, errno == EINVAL ? "not a trace, no records, or a bad record" : strerror(errno));
+      return 1;
     }
-    
-    if (select_result > 0) {
-      char buffer[256];
-      int bytes_received = recv(clientfd, buffer, sizeof(buffer) - 1, 0);
-      
-      if (bytes_received > 0) {
-        buffer[bytes_received] = '\0';
-        
-        if (strcmp(buffer, "OK\n") == 0) {
-          double server_result;
-          int is_float;
-          
-          // After connection, send random assignment
-          sendAssignment(clientfd, &server_result, &is_float);
-          
-          // So basically, let's wait 5secs for an answer
-          FD_ZERO(&readfds); 
-          FD_SET(clientfd, &readfds);
-          timeout.tv_sec = 5;
-          timeout.tv_usec = 0;
-          
-          // use select to wait for answer
-          int answer_result = select(clientfd + 1, &readfds, NULL, NULL, &timeout);
-          
-          if (answer_result == 0) { // send timeout if no answer
-            const char *timeout_msg = "ERROR TO\n";
-            send(clientfd, timeout_msg, strlen(timeout_msg), 0);
-            close(clientfd);
-          } else if (answer_result > 0) {
-            // Receive client's answer
-            char answer_buffer[256];
-            int answer_bytes = recv(clientfd, answer_buffer, sizeof(answer_buffer) - 1, 0);
-            
-            if (answer_bytes > 0) {
-              answer_buffer[answer_bytes] = '\0';
-              
-              double client_result = atof(answer_buffer);
-              int correct = 0;
-              
-              if (is_float) {
-                // Float comparison with tolerance
-                if (fabs(client_result - server_result) < 0.0001) {
-                  correct = 1;
-                }
-              } else {
-                // Integer exact comparison
-                if ((int)client_result == (int)server_result) {
-                  correct = 1;
-                }
-              }
-              
-              if (correct) {
-                const char *ok_msg = "OK\n";
-                send(clientfd, ok_msg, strlen(ok_msg), 0);
-              } else {
-                const char *error_msg = "ERROR\n";
-                send(clientfd, error_msg, strlen(error_msg), 0);
-              }
-            }
-            close(clientfd);
-          } else {
-            close(clientfd);
-          }
-        } else {
-          close(clientfd);
-        }
-      } else {
-        close(clientfd);
+#ifdef DEBUG
+    printf("Replaying %lu assignments from %s\n", replay.count, replay_path);
+#endif
+  }
+
+  if (record_path != NULL) {
+    trace_fd = traceCreate(record_path);
+    if (trace_fd == -1) {
+      printf("--record %s: %s\n", record_path, strerror(errno));
+      return 1;
+    }
+    for (int i = 0; i < nworkers; i++) {
+      if (traceBufferInit(&trace_buffers[i]) != 0) {
+        printf("--record: out of memory\n");
+        return 1;
       }
-    } else {
-      close(clientfd);
     }
+    trace_workers = nworkers;
+  }
+
+  // Only the trace thread (or the stop thread) takes SIGINT/SIGTERM, every thread started from
+  // here inherits the mask
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+  pthread_t stopper;
+  if (pthread_create(&stopper, NULL, record_path != NULL ? runTrace : runStop, NULL) != 0) {
+    printf("pthread_create failed\n");
+    return 1;
+  }
+
+  for (int i = 0; i < nworkers; i++) {
+    workers[i].id = i;
+    workers[i].udp = udp;
+    workers[i].want_uring = uring && !udp; // UDP already batches with recvmmsg/sendmmsg
+    workers[i].metrics = &metrics[i];
+    workers[i].seed = seed + i; // Different sequence per worker
+    workers[i].ring = ring_size > 0 ? &ring : NULL;
+    workers[i].trace = record_path != NULL ? &trace_buffers[i] : NULL;
+    workers[i].replay = replay_path != NULL ? &replay : NULL;
+    // Workers share nothing, so each enforces its part of the limit
+    workers[i].max_sessions = (max_sessions + nworkers - 1) / nworkers;
+    workers[i].eager = eager;
+    workers[i].sndbuf = sndbuf;
+#ifdef DEBUG
+    printf("Worker %d seed %llu\n", i, workers[i].seed);
+#endif
+    if (openWorker(&workers[i], Desthost, Destport, nworkers > 1, backlog) != 0) {
+      return 1;
+    }
+  }
+
+#ifdef DEBUG
+  printf("Server listening on %s:%d (%s) with %d worker(s)\n", Desthost, port, udp ? "UDP" : "TCP", nworkers);
+#endif
+
+  if (stats_port != NULL) {
+    stats_fd = openStats(Desthost, stats_port);
+    if (stats_fd == -1) {
+      return 1;
+    }
+    stats_workers = nworkers;
+
+    pthread_t stats;
+    if (pthread_create(&stats, NULL, runStats, NULL) != 0) {
+      printf("pthread_create failed\n");
+      return 1;
+    }
+#ifdef DEBUG
+    printf("Metrics on http://%s:%s/metrics\n", Desthost, stats_port);
+#endif
+  }
+
+  if (ring_size > 0) {
+    pthread_t producer;
+    if (pthread_create(&producer, NULL, runProducer, &ring) != 0) {
+      printf("pthread_create failed\n");
+      return 1;
+    }
+  }
+
+  if (nworkers == 1) {
+    runWorker(&workers[0]);
+  } else {
+    for (int i = 0; i < nworkers; i++) {
+      if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0) {
+        printf("pthread_create failed\n");
+        return 1;
+      }
+    }
+    for (int i = 0; i < nworkers; i++) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+
+  for (int i = 0; i < nworkers; i++) {
+    close(workers[i].timerfd);
+    close(workers[i].epollfd);
+    close(workers[i].listenfd);
   }
-  
-  close(sockfd);
   return 0;
 }
@@ -0,0 +1,79 @@
+#ifndef __SESSION_TASK
+#define __SESSION_TASK
+
+#include <coroutine>
+#include <exception>
+#include <stdlib.h>
+
+#include "slabPool.h"
+
+/*
+
+  Coroutine type for server sessions.
+
+  A session_task runs as soon as it is called, up to its first co_await, and from then on it is
+  driven by the event loop: the owner of the handle resumes it when what it waits for has
+  happened, and destroys it once done() (a finished task stays suspended at its end so the owner
+  can tell). The promise holds no state; what a wait produced travels through the awaiter.
+
+  Frames come from a per-thread slab pool (slabPool.h) instead of the heap. All sessions run the
+  same coroutine, so their frames are one size: the first frame allocated on a thread sets the
+  size, and from then on starting a session takes a frame from the pool and ending it gives it
+  back. A frame of any other size falls back to malloc. The pool keeps what it is given, so it
+  holds as many frames as the thread once had sessions at the same time.
+
+  If there is no memory for a frame, the call returns a task with a null handle instead of
+  throwing.
+
+*/
+
+struct frame_pool {
+  size_t size;            // the one frame size the pool holds, 0 until the first allocation
+  struct slab_pool slab;
+};
+
+static thread_local struct frame_pool session_frames;
+
+static inline void *framePoolAlloc(size_t size) {
+  struct frame_pool *pool = &session_frames;
+
+  if (pool->size == 0) {
+    pool->size = size;
+    slabPoolInit(&pool->slab, size);
+  }
+  if (size == pool->size) {
+    return slabAlloc(&pool->slab);
+  }
+  return malloc(size);
+}
+
+static inline void framePoolFree(void *frame, size_t size) {
+  struct frame_pool *pool = &session_frames;
+
+  if (size != pool->size) {
+    free(frame);
+    return;
+  }
+  slabFree(&pool->slab, frame);
+}
+
+struct session_task {
+  struct promise_type {
+    session_task get_return_object() {
+      return session_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    static session_task get_return_object_on_allocation_failure() { return session_task{nullptr}; }
+
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    static void *operator new(size_t size) noexcept { return framePoolAlloc(size); }
+    static void operator delete(void *frame, size_t size) { framePoolFree(frame, size); }
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef __SIP_HASH
+#define __SIP_HASH
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+
+  SipHash-2-4 (Aumasson and Bernstein), a keyed 64-bit MAC that is fast on short inputs.
+
+  The UDP server uses it to sign the cookies it hands out, so it can trust what comes back
+  without remembering anything. The key stays in the server; without it nobody can make a
+  cookie that verifies. "make bench" checks the implementation against the reference vector.
+
+*/
+
+#define SIP_HASH_KEY_SIZE 16
+
+static inline uint64_t sipRotl(uint64_t x, int b) {
+  return (x << b) | (x >> (64 - b));
+}
+
+static inline uint64_t sipLoad64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v |= (uint64_t)p[i] << (8 * i);
+  }
+  return v;
+}
+
+#define SIP_ROUND(v0, v1, v2, v3)                                   \
+  do {                                                              \
+    v0 += v1; v1 = sipRotl(v1, 13); v1 ^= v0; v0 = sipRotl(v0, 32); \
+    v2 += v3; v3 = sipRotl(v3, 16); v3 ^= v2;                       \
+    v0 += v3; v3 = sipRotl(v3, 21); v3 ^= v0;                       \
+    v2 += v1; v1 = sipRotl(v1, 17); v1 ^= v2; v2 = sipRotl(v2, 32); \
+  } while (0)
+
+/* MAC of the len bytes at in under key. */
+static inline uint64_t sipHash24(const unsigned char key[SIP_HASH_KEY_SIZE], const unsigned char *in, size_t len) {
+  uint64_t k0 = sipLoad64(key);
+  uint64_t k1 = sipLoad64(key + 8);
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+  const unsigned char *end = in + (len & ~(size_t)7);
+
+  for (; in != end; in += 8) {
+    uint64_t m = sipLoad64(in);
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  // Last block: the remaining bytes, with the length in the top byte
+  uint64_t b = (uint64_t)len << 56;
+  for (size_t i = 0; i < (len & 7); i++) {
+    b |= (uint64_t)in[i] << (8 * i);
+  }
+
+  v3 ^= b;
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIP_ROUND
+
+#endif
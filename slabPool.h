@@ -0,0 +1,76 @@
+#ifndef __SLAB_POOL
+#define __SLAB_POOL
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+/*
+
+  Fixed-size object pool, one per worker and object kind, for what the server allocates per
+  session: the session itself, its coroutine frame (sessionTask.h), the expected results of a
+  pipelined session and the io_uring output blocks.
+
+  Objects are carved out of slabs of SLAB_OBJECTS objects, mapped straight from the kernel, so
+  every object starts on a cache line (the size is rounded up to a multiple of 64) and the pages
+  of a slab only take memory once they are used. A freed object goes on the pool's free list and
+  is handed out again before a new slab is mapped. Once a worker has seen its peak number of
+  sessions, opening and closing one is a pop and a push on a list, without malloc or free.
+
+  Like the coroutine frame list in sessionTask.h, a pool keeps what it is given: slabs are never
+  unmapped. Only the owning worker may use a pool, there is no locking.
+
+*/
+
+#define SLAB_OBJECTS 256 // objects per slab
+
+struct slab_pool {
+  size_t size;     // object size, a multiple of 64
+  void *free;      // freed objects, each starting with the pointer to the next
+  char *next;      // the newest slab's objects that were never handed out start here
+  char *end;
+  long slabs;      // slabs mapped so far
+  long in_use;     // objects handed out and not freed yet
+};
+
+static inline void slabPoolInit(struct slab_pool *pool, size_t size) {
+  pool->size = (size + 63) & ~(size_t)63;
+  pool->free = NULL;
+  pool->next = NULL;
+  pool->end = NULL;
+  pool->slabs = 0;
+  pool->in_use = 0;
+}
+
+/* An object of pool->size bytes, not zeroed. NULL if there is no memory for another slab. */
+static inline void *slabAlloc(struct slab_pool *pool) {
+  void *object = pool->free;
+
+  if (object != NULL) {
+    pool->free = *(void **)object;
+  } else {
+    if (pool->next == pool->end) {
+      size_t len = pool->size * SLAB_OBJECTS;
+      char *slab = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (slab == MAP_FAILED) {
+        return NULL;
+      }
+      pool->next = slab;
+      pool->end = slab + len;
+      pool->slabs++;
+    }
+    // Never-used objects are taken in address order, so a page is only touched when it is needed
+    object = pool->next;
+    pool->next += pool->size;
+  }
+
+  pool->in_use++;
+  return object;
+}
+
+static inline void slabFree(struct slab_pool *pool, void *object) {
+  *(void **)object = pool->free;
+  pool->free = object;
+  pool->in_use--;
+}
+
+#endif
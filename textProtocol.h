@@ -0,0 +1,78 @@
+#ifndef __TEXT_PROTOCOL
+#define __TEXT_PROTOCOL
+
+#include <string_view>
+
+#include "calcOps.h"
+#include "numCodec.h"
+
+/*
+
+  TEXT TCP 1.0 and 1.1, as far as server, client and bench share them: the greeting the server
+  opens with, and how an assignment line ("<op> <v1> <v2>", as renderAssignment() in
+  assignmentRing.h writes it) is taken apart and answered. The exchanges are described in
+  servermain.cpp.
+
+*/
+
+// The protocols the server offers, one per line, up to the empty line
+#define GREETING "TEXT TCP 1.0\nTEXT TCP 1.1\nBINARY TCP 1.0\n\n"
+
+struct assignment_fields {
+  std::string_view operation;
+  std::string_view value1;
+  std::string_view value2;
+};
+
+/* Splits an assignment line (without its '\n') at the blanks. Returns false if it does not have
+   three fields. */
+static inline bool splitAssignment(std::string_view line, struct assignment_fields *f) {
+  size_t space1 = line.find(' ');
+  if (space1 == std::string_view::npos) {
+    return false;
+  }
+
+  // The server pads floats to 8 characters ("%8.8g"), so there can be several spaces
+  size_t value1_start = line.find_first_not_of(' ', space1);
+  size_t space2 = line.find(' ', value1_start);
+  size_t value2_start = line.find_first_not_of(' ', space2);
+  if (space2 == std::string_view::npos || value2_start == std::string_view::npos) {
+    return false;
+  }
+
+  f->operation = line.substr(0, space1);
+  f->value1 = line.substr(value1_start, space2 - value1_start);
+  f->value2 = line.substr(value2_start);
+  return true;
+}
+
+/* Solves a split assignment and writes the answer line, with its '\n', to answer (at least
+   NUM_MAX_CHARS + 1 bytes). The operands are read, and the result written, the way the operator's
+   type asks for; an unknown operator gets "0". Returns the length. */
+static inline int answerAssignment(const struct assignment_fields *f, char *answer) {
+  int op = calcOpLookup(f->operation);
+  int len;
+
+  if (op < 0) {
+    answer[0] = '0';
+    len = 1;
+  } else {
+    const struct calc_op_info *info = &calc_ops[op];
+    const char *v1 = f->value1.data(), *v2 = f->value2.data();
+    double value1, value2;
+
+    if (info->is_float) {
+      value1 = parseDouble(v1, v1 + f->value1.size());
+      value2 = parseDouble(v2, v2 + f->value2.size());
+    } else {
+      value1 = parseInt(v1, v1 + f->value1.size());
+      value2 = parseInt(v2, v2 + f->value2.size());
+    }
+    len = info->format(answer, info->eval(value1, value2));
+  }
+
+  answer[len++] = '\n';
+  return len;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include <stddef.h>
+
+#include "timerWheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static void unlinkNode(struct timer_node *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->next = NULL;
+  node->prev = NULL;
+}
+
+void timerWheelInit(struct timer_wheel *tw, long long now_ms, long long tick_ms) {
+  for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    tw->slots[i].next = &tw->slots[i];
+    tw->slots[i].prev = &tw->slots[i];
+  }
+  tw->tick_ms = tick_ms;
+  tw->current_tick = now_ms / tick_ms;
+  tw->count = 0;
+}
+
+void timerArm(struct timer_wheel *tw, struct timer_node *node, long long deadline_ms) {
+  if (node->next) {
+    unlinkNode(node);
+    tw->count--;
+  }
+
+  // Round up, a timer may fire late by up to one tick but never early
+  unsigned long long tick = (deadline_ms + tw->tick_ms - 1) / tw->tick_ms;
+  if (tick <= tw->current_tick) {
+    tick = tw->current_tick + 1;
+  }
+  node->expires = tick;
+
+  struct timer_node *head = &tw->slots[tick & SLOT_MASK];
+  node->next = head;
+  node->prev = head->prev;
+  head->prev->next = node;
+  head->prev = node;
+  tw->count++;
+}
+
+void timerCancel(struct timer_wheel *tw, struct timer_node *node) {
+  if (node->next) {
+    unlinkNode(node);
+    tw->count--;
+  }
+}
+
+static int expireSlot(struct timer_wheel *tw, struct timer_node *head, unsigned long long tick,
+                      timer_expire_fn expire, void *arg) {
+  int expired = 0;
+  struct timer_node *node = head->next;
+
+  while (node != head) {
+    struct timer_node *next = node->next;
+
+    if (node->expires <= tick) {
+      unlinkNode(node);
+      tw->count--;
+      expired++;
+      expire(node, arg);
+    }
+    node = next;
+  }
+  return expired;
+}
+
+int timerAdvance(struct timer_wheel *tw, long long now_ms, timer_expire_fn expire, void *arg) {
+  unsigned long long target = now_ms / tw->tick_ms;
+  int expired = 0;
+
+  if (tw->count == 0 || target <= tw->current_tick) {
+    if (target > tw->current_tick) {
+      tw->current_tick = target;
+    }
+    return 0;
+  }
+
+  if (target - tw->current_tick >= TIMER_WHEEL_SLOTS) {
+    // We fell more than a revolution behind, one pass over every slot catches up
+    for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+      expired += expireSlot(tw, &tw->slots[i], target, expire, arg);
+    }
+    tw->current_tick = target;
+    return expired;
+  }
+
+  while (tw->current_tick < target) {
+    tw->current_tick++;
+    expired += expireSlot(tw, &tw->slots[tw->current_tick & SLOT_MASK], tw->current_tick, expire, arg);
+  }
+  return expired;
+}
@@ -0,0 +1,51 @@
+#ifndef __TIMER_WHEEL
+#define __TIMER_WHEEL
+
+/*
+
+  Hashed timing wheel for per-session deadlines.
+
+  Time is cut into ticks of tick_ms milliseconds. A timer that expires at tick T hangs in slot
+  T % TIMER_WHEEL_SLOTS, so arming and cancelling is an O(1) list operation no matter how many
+  timers there are. Advancing the wheel visits one slot per elapsed tick and only touches the
+  timers that are due (plus, for deadlines further away than one revolution, the ones that have
+  laps left).
+
+  The timer_node is embedded in the object that owns the timer; the expire callback gets the
+  node back and can find its owner with offsetof.
+
+  Implementation in timerWheel.cpp
+
+*/
+
+#define TIMER_WHEEL_SLOTS 1024 // Must be a power of two
+
+struct timer_node {
+  struct timer_node *prev;
+  struct timer_node *next;     // NULL when not armed
+  unsigned long long expires;  // tick number
+};
+
+struct timer_wheel {
+  struct timer_node slots[TIMER_WHEEL_SLOTS]; // list heads
+  unsigned long long current_tick;             // last tick that has been processed
+  long long tick_ms;
+  int count;                                   // armed timers
+};
+
+typedef void (*timer_expire_fn)(struct timer_node *node, void *arg);
+
+void timerWheelInit(struct timer_wheel *tw, long long now_ms, long long tick_ms);
+
+// Arm (or re-arm) node to fire at the first tick at or after deadline_ms.
+void timerArm(struct timer_wheel *tw, struct timer_node *node, long long deadline_ms);
+
+// Disarm node, harmless if it is not armed.
+void timerCancel(struct timer_wheel *tw, struct timer_node *node);
+
+// Process every tick up to now_ms, calling expire for each timer that is due. The node is
+// already disarmed when expire runs, so the callback may free it (but not cancel other timers).
+// Returns the number of expired timers.
+int timerAdvance(struct timer_wheel *tw, long long now_ms, timer_expire_fn expire, void *arg);
+
+#endif
@@ -0,0 +1,180 @@
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+#include "calcOps.h"
+
+static long long clockNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int writeAll(int fd, const void *data, size_t len) {
+  const char *p = (const char *)data;
+
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int traceCreate(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct trace_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+  h.record_size = sizeof(struct trace_record);
+  h.start_realtime_ns = clockNs(CLOCK_REALTIME);
+  h.start_monotonic_ns = clockNs(CLOCK_MONOTONIC);
+
+  if (writeAll(fd, &h, sizeof(h)) != 0) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+int traceBufferInit(struct trace_buffer *tb) {
+  tb->blocks = (struct trace_block *)calloc(TRACE_BLOCKS, sizeof(struct trace_block));
+  if (tb->blocks == NULL) {
+    return -1;
+  }
+  tb->block_ms = 0;
+  tb->filled.store(0, std::memory_order_relaxed);
+  tb->written.store(0, std::memory_order_relaxed);
+  tb->stopping.store(false, std::memory_order_relaxed);
+  return 0;
+}
+
+/* Writes every block the workers have handed over. Returns 0 if there was none. */
+static int writeBlocks(int fd, struct trace_buffer *buffers, int n) {
+  int wrote = 0;
+
+  for (int i = 0; i < n; i++) {
+    struct trace_buffer *tb = &buffers[i];
+    unsigned long written = tb->written.load(std::memory_order_relaxed);
+
+    while (written != tb->filled.load(std::memory_order_acquire)) {
+      struct trace_block *b = &tb->blocks[written % TRACE_BLOCKS];
+      // If the disk is full the records are lost, the server carries on
+      writeAll(fd, b->records, b->count * sizeof(struct trace_record));
+      b->count = 0;
+      tb->written.store(++written, std::memory_order_release);
+      wrote = 1;
+    }
+  }
+  return wrote;
+}
+
+void traceWriterRun(int fd, struct trace_buffer *buffers, int n) {
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+
+  // Wait for the signal whenever there is nothing to write, it comes in right away
+  struct timespec pause = {0, TRACE_FLUSH_MS * 1000000L / 4};
+  struct timespec poll = {0, 0};
+  while (sigtimedwait(&stop, NULL, writeBlocks(fd, buffers, n) ? &poll : &pause) == -1) {
+  }
+
+  for (int i = 0; i < n; i++) {
+    buffers[i].stopping.store(true, std::memory_order_relaxed);
+  }
+  // Every worker goes round its loop within TRACE_FLUSH_MS, handing over its last block
+  for (int waited = 0; waited < 2 * TRACE_FLUSH_MS; waited += TRACE_FLUSH_MS / 4) {
+    nanosleep(&pause, NULL);
+    writeBlocks(fd, buffers, n);
+  }
+  close(fd);
+}
+
+/* Whether replay can hand out t as it is: a known operator, outcome and protocol, finite values,
+   and integer operands that an int32 holds (what BINARY TCP 1.0 sends and calcFormatInt() can
+   write). The answer is not replayed and may be anything the client sent. */
+static bool recordValid(const struct trace_record *t) {
+  if (t->op >= CALC_OP_COUNT || t->outcome > TRACE_SENT || t->protocol > TRACE_UDP) {
+    return false;
+  }
+  if (!isfinite(t->value1) || !isfinite(t->value2) || !isfinite(t->result)) {
+    return false;
+  }
+  if (!calcOpIsFloat(t->op)) {
+    return t->value1 >= INT32_MIN && t->value1 <= INT32_MAX && t->value2 >= INT32_MIN && t->value2 <= INT32_MAX;
+  }
+  return true;
+}
+
+int traceReplayOpen(struct trace_replay *r, const char *path) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+
+  size_t size = st.st_size;
+  if (size <= sizeof(struct trace_header)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  int saved = errno;
+  close(fd); // The mapping stays
+  if (map == MAP_FAILED) {
+    errno = saved;
+    return -1;
+  }
+
+  const struct trace_header *h = (const struct trace_header *)map;
+  r->records = (const struct trace_record *)(h + 1);
+  // A trace that is still being recorded may end in the middle of a record, that one is left out
+  r->count = (size - sizeof(*h)) / sizeof(struct trace_record);
+  r->map = map;
+  r->map_size = size;
+  r->next.store(0, std::memory_order_relaxed);
+
+  int valid = memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) == 0 && h->record_size == sizeof(struct trace_record) &&
+              r->count > 0;
+  for (unsigned long i = 0; valid && i < r->count; i++) {
+    valid = recordValid(&r->records[i]);
+  }
+  if (!valid) {
+    munmap(map, size);
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,154 @@
+#ifndef __TRACE
+#define __TRACE
+
+#include <atomic>
+#include <string.h>
+
+/*
+
+  Assignment traces. With --record FILE the server writes every assignment it hands out to a
+  trace file, with the reference result, the client's answer, the timestamps and the outcome.
+  With --replay FILE it hands out the assignments of such a file again, in the same order,
+  instead of drawing new ones.
+
+  A trace file is a trace_header followed by fixed-size trace_records in host byte order. Records
+  are only ever appended, so record i sits at a known offset and a trace can be read while it is
+  still being written. An assignment is recorded when its outcome is known, so records are in the
+  order the assignments finished, which within a session is the order they were handed out.
+
+  Recording never blocks a worker on the disk. Every worker fills its own trace_buffer, a few
+  blocks of records: a full block goes to the trace thread, which writes it out while the worker
+  fills the next one. A block that has been open for TRACE_FLUSH_MS is handed over half full, so
+  the file of a quiet server keeps up. If the disk falls so far behind that every block is waiting,
+  new records are dropped (the worker counts them) rather than the worker waiting.
+
+  SIGINT and SIGTERM go to the trace thread (the server blocks them everywhere else). It asks every
+  worker to hand over what it has right away, writes that out, and ends the server, so a stopped
+  server leaves a complete trace.
+
+  Replay maps the whole file and all workers take records from one shared cursor. After the last
+  record it starts over at the first.
+
+  Implementation in trace.cpp
+
+*/
+
+#define TRACE_MAGIC "CALCTRC1"
+#define TRACE_BLOCK_RECORDS 512 // records per block, 32 KB
+#define TRACE_BLOCKS 8          // blocks per worker
+#define TRACE_FLUSH_MS 100      // longest a record waits in a worker's block
+
+enum trace_outcome {
+  TRACE_OK,      // answered correctly
+  TRACE_ERROR,   // answered wrong
+  TRACE_TIMEOUT, // no answer in time (ERROR TO)
+  TRACE_CLOSED,  // the session ended before the answer came: client gone, or a bad record
+  TRACE_SENT     // TEXT UDP 1.0, the server keeps no state, so all it knows is what it sent
+};
+
+enum trace_protocol { TRACE_TEXT, TRACE_BINARY, TRACE_UDP };
+
+struct trace_header {
+  char magic[8];                // TRACE_MAGIC, without the NUL
+  unsigned int record_size;     // sizeof(struct trace_record)
+  unsigned int reserved;
+  long long start_realtime_ns;  // CLOCK_REALTIME and CLOCK_MONOTONIC when the trace was created,
+  long long start_monotonic_ns; // to turn the timestamps of the records into wall clock time
+  char padding[32];
+};
+
+struct trace_record {
+  double value1;                // the operands, as the client got them
+  double value2;
+  double result;                // the server's reference result
+  double answer;                // the client's answer, 0 if there was none
+  long long issued_ns;          // CLOCK_MONOTONIC, assignment sent
+  long long finished_ns;        // verdict sent, timed out, or session closed; 0 for TRACE_SENT
+  unsigned int session;         // numbered per worker from 1, 0 for UDP
+  unsigned short index;         // position of the assignment in its session
+  unsigned char op;             // enum calc_op
+  unsigned char outcome;        // enum trace_outcome
+  unsigned char protocol;       // enum trace_protocol
+  unsigned char worker;
+  unsigned char padding[6];
+};
+
+static_assert(sizeof(struct trace_header) == 64, "trace_header is part of the file format");
+static_assert(sizeof(struct trace_record) == 64, "trace_record is part of the file format");
+
+struct trace_block {
+  unsigned int count;           // records filled in
+  struct trace_record records[TRACE_BLOCK_RECORDS];
+};
+
+struct trace_buffer {
+  struct trace_block *blocks;                     // TRACE_BLOCKS of them
+  long long block_ms;                             // worker: when the current block got its first record
+  alignas(64) std::atomic<unsigned long> filled;  // blocks handed to the trace thread, written by the worker
+  alignas(64) std::atomic<unsigned long> written; // blocks on disk and free again, written by the trace thread
+  std::atomic<bool> stopping;                     // the server is about to exit, hand over every record now
+};
+
+struct trace_replay {
+  const struct trace_record *records; // mapped from the file
+  unsigned long count;
+  size_t map_size;
+  void *map;
+  std::atomic<unsigned long> next;
+};
+
+/* Creates (or truncates) path and writes the header. Returns the fd, or -1 with errno set. */
+int traceCreate(const char *path);
+
+/* Returns 0, or -1 if there is no memory for the blocks. */
+int traceBufferInit(struct trace_buffer *tb);
+
+/* Writes the blocks the n workers hand over to fd, until SIGINT or SIGTERM. Then it collects the
+   workers' last records and returns, and the server should exit. Run it on its own thread, with
+   both signals blocked in every thread. */
+void traceWriterRun(int fd, struct trace_buffer *buffers, int n);
+
+/* Adds one record. Returns false if it had to be dropped. Only the owning worker may call this. */
+static inline bool traceAppend(struct trace_buffer *tb, const struct trace_record *r, long long now_ms) {
+  unsigned long filled = tb->filled.load(std::memory_order_relaxed);
+  if (filled - tb->written.load(std::memory_order_acquire) == TRACE_BLOCKS) {
+    return false;
+  }
+
+  struct trace_block *b = &tb->blocks[filled % TRACE_BLOCKS];
+  if (b->count == 0) {
+    tb->block_ms = now_ms;
+  }
+  memcpy(&b->records[b->count], r, sizeof(*r));
+  if (++b->count == TRACE_BLOCK_RECORDS) {
+    tb->filled.store(filled + 1, std::memory_order_release);
+  }
+  return true;
+}
+
+/* Whether the worker's current block holds records that have not been handed over yet. */
+static inline bool tracePending(const struct trace_buffer *tb) {
+  unsigned long filled = tb->filled.load(std::memory_order_relaxed);
+  return filled - tb->written.load(std::memory_order_acquire) < TRACE_BLOCKS &&
+         tb->blocks[filled % TRACE_BLOCKS].count > 0;
+}
+
+/* Hands the current block over if it has been open for TRACE_FLUSH_MS, or the server is stopping.
+   Call it from the worker's loop, and wake up for it while tracePending(). */
+static inline void traceFlush(struct trace_buffer *tb, long long now_ms) {
+  if (tracePending(tb) && (now_ms - tb->block_ms >= TRACE_FLUSH_MS || tb->stopping.load(std::memory_order_relaxed))) {
+    tb->filled.store(tb->filled.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+}
+
+/* Maps the trace at path for replay. Returns 0, or -1 with errno set (EINVAL if it is not a
+   trace, has no records, or a record that cannot be handed out again: an unknown operator,
+   outcome or protocol, a value that is not finite, or an integer operand beyond int32). */
+int traceReplayOpen(struct trace_replay *r, const char *path);
+
+/* The next record to hand out. Any thread. */
+static inline const struct trace_record *traceReplayNext(struct trace_replay *r) {
+  return &r->records[r->next.fetch_add(1, std::memory_order_relaxed) % r->count];
+}
+
+#endif
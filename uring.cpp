@@ -0,0 +1,201 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sysSetup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sysEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sysRegister(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void unmapRings(struct uring *u) {
+  if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+    munmap(u->sqes, u->sqes_size);
+  }
+  if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+    munmap(u->cq_ring, u->cq_ring_size);
+  }
+  if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED) {
+    munmap(u->sq_ring, u->sq_ring_size);
+  }
+}
+
+static int mapRings(struct uring *u, struct io_uring_params *p) {
+  u->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  u->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (u->features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size > u->sq_ring_size) {
+      u->sq_ring_size = u->cq_ring_size;
+    }
+    u->cq_ring_size = u->sq_ring_size;
+  }
+
+  u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ring == MAP_FAILED) {
+    return -errno;
+  }
+  if (u->features & IORING_FEAT_SINGLE_MMAP) {
+    u->cq_ring = u->sq_ring;
+  } else {
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ring == MAP_FAILED) {
+      return -errno;
+    }
+  }
+
+  u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) {
+    return -errno;
+  }
+
+  char *sq = (char *)u->sq_ring;
+  u->sq_head = (unsigned *)(sq + p->sq_off.head);
+  u->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+  u->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+  u->sq_entries = p->sq_entries;
+  u->sq_array = (unsigned *)(sq + p->sq_off.array);
+  u->sq_local_tail = *u->sq_tail;
+
+  // Submission slot i always uses entry i, so the indirection array is filled once
+  for (unsigned i = 0; i < p->sq_entries; i++) {
+    u->sq_array[i] = i;
+  }
+
+  char *cq = (char *)u->cq_ring;
+  u->cq_head = (unsigned *)(cq + p->cq_off.head);
+  u->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+  u->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+  return 0;
+}
+
+static int registerBuffers(struct uring *u, unsigned buf_count, unsigned buf_size) {
+  u->buf_count = buf_count;
+  u->buf_size = buf_size;
+  u->buf_ring_size = buf_count * sizeof(struct io_uring_buf);
+  u->buf_ring = (struct io_uring_buf_ring *)mmap(NULL, u->buf_ring_size, PROT_READ | PROT_WRITE,
+                                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->buf_ring == MAP_FAILED) {
+    u->buf_ring = NULL;
+    return -errno;
+  }
+  u->buffers = (char *)mmap(NULL, (size_t)buf_count * buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (u->buffers == MAP_FAILED) {
+    u->buffers = NULL;
+    return -errno;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)u->buf_ring;
+  reg.ring_entries = buf_count;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (sysRegister(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    return -errno;
+  }
+
+  u->buf_tail = 0;
+  for (unsigned bid = 0; bid < buf_count; bid++) {
+    uringRecycleBuffer(u, bid);
+  }
+  return 0;
+}
+
+int uringInit(struct uring *u, unsigned entries, unsigned buf_count, unsigned buf_size) {
+  struct io_uring_params p;
+
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+
+  // Only this worker's thread submits, and completions are only handled when it waits, so the
+  // kernel can skip the cross-thread wakeups. Both flags need Linux 6.1, which also has every
+  // operation we use (multishot accept and recv, provided buffer rings); an older kernel says
+  // EINVAL here and the server stays on epoll.
+  p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  p.flags |= IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 4; // Multishot operations post many completions per submission
+
+  u->fd = sysSetup(entries, &p);
+  if (u->fd < 0) {
+    return -errno;
+  }
+  u->features = p.features;
+
+  int rv = -EINVAL;
+  if (!(u->features & IORING_FEAT_EXT_ARG) || (rv = mapRings(u, &p)) != 0 ||
+      (rv = registerBuffers(u, buf_count, buf_size)) != 0) {
+    uringExit(u);
+    return rv;
+  }
+  return 0;
+}
+
+void uringExit(struct uring *u) {
+  unmapRings(u);
+  if (u->buffers != NULL) {
+    munmap(u->buffers, (size_t)u->buf_count * u->buf_size);
+  }
+  if (u->buf_ring != NULL) {
+    munmap(u->buf_ring, u->buf_ring_size);
+  }
+  close(u->fd);
+  u->fd = -1;
+}
+
+struct io_uring_sqe *uringGetSqe(struct uring *u) {
+  while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+    // Full: hand what we have to the kernel without waiting for anything
+    unsigned to_submit = u->sq_local_tail - *u->sq_head;
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    if (sysEnter(u->fd, to_submit, 0, 0, NULL, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      return NULL;
+    }
+  }
+
+  struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & u->sq_mask];
+  u->sq_local_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+int uringSubmitAndWait(struct uring *u, int timeout_ms) {
+  unsigned to_submit = u->sq_local_tail - *u->sq_head;
+  __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    arg.ts = (unsigned long)&ts;
+  }
+
+  if (sysEnter(u->fd, to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+    return -errno;
+  }
+  return 0;
+}
+
+void uringRecycleBuffer(struct uring *u, unsigned bid) {
+  // Not u->buf_ring->bufs: in C++ the kernel header's flexible array member comes out 8 bytes
+  // into the ring instead of at its start
+  struct io_uring_buf *buf = (struct io_uring_buf *)u->buf_ring + (u->buf_tail & (u->buf_count - 1));
+
+  buf->addr = (unsigned long)uringBuffer(u, bid);
+  buf->len = u->buf_size;
+  buf->bid = bid;
+  u->buf_tail++;
+  __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,94 @@
+#ifndef __URING
+#define __URING
+
+#include <linux/io_uring.h>
+
+/*
+
+  A minimal io_uring, talking to the kernel with the raw syscalls (no liburing).
+
+  The submission and completion rings are shared with the kernel through mmap. uringGetSqe()
+  hands out the next free submission entry, uringSubmitAndWait() passes everything prepared
+  since the last call to the kernel and waits for completions in the same syscall, and
+  uringPeekCqe()/uringCqeSeen() walk the completions. Nothing is submitted behind the caller's
+  back except when the submission ring is full.
+
+  Receives use a ring of provided buffers (IORING_REGISTER_PBUF_RING): the kernel picks a free
+  buffer when data arrives, so a multishot recv needs no buffer of its own while it waits. The
+  completion names the buffer; hand it back with uringRecycleBuffer() once the data is copied out.
+
+  Implementation in uring.cpp
+
+*/
+
+#define URING_BUFFER_GROUP 0
+
+struct uring {
+  int fd;
+  unsigned features;                   // IORING_FEAT_* of the running kernel
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned sq_local_tail;              // entries handed out, published on submit
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;                       // same as sq_ring with IORING_FEAT_SINGLE_MMAP
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  struct io_uring_buf_ring *buf_ring;  // provided buffers
+  size_t buf_ring_size;
+  char *buffers;
+  unsigned buf_count;                  // a power of two
+  unsigned buf_size;
+  unsigned short buf_tail;
+};
+
+/* Set up a ring of entries submission entries, with buf_count provided receive buffers of
+   buf_size bytes. Returns 0, or a negative errno if this kernel cannot do what we need
+   (multishot accept and recv, provided buffer rings, waits with a timeout). */
+int uringInit(struct uring *u, unsigned entries, unsigned buf_count, unsigned buf_size);
+
+void uringExit(struct uring *u);
+
+/* The next free submission entry, zeroed. Submits what is queued if the ring is full. */
+struct io_uring_sqe *uringGetSqe(struct uring *u);
+
+/* Submit everything queued and wait until there is at least one completion, or timeout_ms
+   milliseconds (-1 to wait without a timeout). Returns 0 or a negative errno; -ETIME and
+   -EINTR just mean nothing completed. */
+int uringSubmitAndWait(struct uring *u, int timeout_ms);
+
+/* The oldest unseen completion, or NULL. */
+static inline struct io_uring_cqe *uringPeekCqe(struct uring *u) {
+  unsigned head = *u->cq_head;
+  if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  return &u->cqes[head & u->cq_mask];
+}
+
+/* Hand the completion from uringPeekCqe() back to the kernel. */
+static inline void uringCqeSeen(struct uring *u) {
+  __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Data of provided buffer bid. */
+static inline char *uringBuffer(struct uring *u, unsigned bid) {
+  return u->buffers + (size_t)bid * u->buf_size;
+}
+
+/* Give provided buffer bid back to the kernel. */
+void uringRecycleBuffer(struct uring *u, unsigned bid);
+
+#endif
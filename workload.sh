@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# The same load every time, on loopback: starts a server with a fixed seed, runs the client's load
+# mode against it in three phases (TEXT TCP 1.0, TEXT TCP 1.1 with 8 assignments, BINARY TCP 1.0
+# with 8 assignments) and stops it with SIGTERM. "make pgo" trains the instrumented build with it;
+# run it on any build to compare them.
+#
+# usage: ./workload.sh [server] [client] [port]
+#
+# Prints sessions/s and the server's CPU time per session for each phase, in all and in user space
+# (what the compiler can change; the rest is the kernel's socket work). SESSIONS (default 50000)
+# and CONNECTIONS (default 16) in the environment change the size of the load.
+
+SERVER=${1:-./server}
+CLIENT=${2:-./client}
+ADDRESS=127.0.0.1:${3:-5799}
+SESSIONS=${SESSIONS:-50000}
+CONNECTIONS=${CONNECTIONS:-16}
+TICK=$(getconf CLK_TCK)
+
+"$SERVER" "$ADDRESS" --seed 1 --workers 2 >/dev/null &
+pid=$!
+
+# Wait for it to listen
+tries=0
+until "$CLIENT" "$ADDRESS" >/dev/null 2>&1; do
+  tries=$((tries + 1))
+  if [ $tries -ge 50 ] || ! kill -0 $pid 2>/dev/null; then
+    echo "$SERVER did not come up on $ADDRESS"
+    kill $pid 2>/dev/null
+    exit 1
+  fi
+  sleep 0.1
+done
+
+# utime and stime of the server, in clock ticks
+cpuTicks() {
+  awk '{print $14, $15}' /proc/$pid/stat
+}
+
+phase() {
+  name=$1
+  shift
+  before=$(cpuTicks)
+  out=$("$CLIENT" "$ADDRESS" --connections "$CONNECTIONS" --sessions "$SESSIONS" "$@" 2>&1)
+  after=$(cpuTicks)
+  echo "$out" | awk -v name="$name" -v before="$before" -v after="$after" -v hz="$TICK" -v n="$SESSIONS" '
+    BEGIN { split(before, b, " "); split(after, a, " "); user = a[1] - b[1]; sys = a[2] - b[2] }
+    /^sessions:/ { rate = $6; sub(/^\(/, "", rate) }
+    /^OK:/ { failed = $4 + $6 + $8 + $10 }
+    END { printf "%-16s %10.1f sessions/s %8.2f us server cpu/session (%.2f user) %s\n", name, rate,
+          (user + sys) * 1e6 / hz / n, user * 1e6 / hz / n, (failed > 0 ? "(" failed " not OK)" : "") }'
+}
+
+phase "text"
+phase "text pipelined" --assignments 8 --protocol text
+phase "binary" --assignments 8 --protocol binary
+
+kill -TERM $pid
+wait $pid